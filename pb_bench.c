@@ -0,0 +1,381 @@
+/*
+ * picoBot: A Educational IRC Bot
+ * Copyright (c) 2017 pico
+ *
+ * This file is part of picoBot
+ *
+ * picoBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picoBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picoBot.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* picoBot benchmarks. The bot is built in without its main */
+#define PB_NO_MAIN
+#include "picobot4.c"
+
+#include <malloc.h>
+
+#define BENCH_N      1000000
+#define BENCH_IDLE   512     // Sessions for the idle footprint
+#define BENCH_LAT    20000   // Round trips per latency run
+#define BENCH_SPIN   50      // Low latency spin. Microseconds
+#define BENCH_BUSY   256     // Sessions for the pipeline runs
+#define BENCH_ROUNDS 200     // Bursts per session
+#define BENCH_TRIES  5
+
+typedef struct bench_t {
+  char      *name;
+  long long (*f) (PB_SESSION *s, int n);
+} BENCH;
+
+static PB_TMPL *tm;
+
+long long
+pb_bench_ns (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* pb_printf as it was before the output queue: a 4KB memset and a
+ * vsnprintf to the stack, then a write per reply */
+int
+pb_bench_printf_old (PB_SESSION *s, char *fmt,...) {
+  char    buf[BSIZE];
+  int     len;
+  va_list arg;
+
+  va_start (arg, fmt);
+  memset (buf, 0, BSIZE);
+  if ((len = vsnprintf (buf, BSIZE, fmt, arg)) >= BSIZE) len = BSIZE - 1;
+  len = write (s->fd, buf, len);
+  va_end (arg);
+
+  return len;
+}
+
+long long
+bench_printf_old (PB_SESSION *s, int n) {
+  long long t = pb_bench_ns ();
+
+  while (n--) pb_bench_printf_old (s, "PRIVMSG %s :Welcome %s\n", "#picobot", "someone");
+  return pb_bench_ns () - t;
+}
+
+long long
+bench_printf (PB_SESSION *s, int n) {
+  long long t = pb_bench_ns ();
+
+  while (n--) {
+    pb_printf (s, "PRIVMSG %s :Welcome %s\n", "#picobot", "someone");
+    s->olen = 0;
+  }
+  return pb_bench_ns () - t;
+}
+
+long long
+bench_tmpl (PB_SESSION *s, int n) {
+  long long t = pb_bench_ns ();
+
+  while (n--) {
+    pb_tmpl_send (s, tm, "#picobot", "someone");
+    s->olen = 0;
+  }
+  return pb_bench_ns () - t;
+}
+
+long long
+bench_printf_flush (PB_SESSION *s, int n) {
+  long long t = pb_bench_ns ();
+
+  while (n--) {
+    pb_printf (s, "PRIVMSG %s :Welcome %s\n", "#picobot", "someone");
+    pb_out_flush (s);
+  }
+  return pb_bench_ns () - t;
+}
+
+long long
+bench_tmpl_flush (PB_SESSION *s, int n) {
+  long long t = pb_bench_ns ();
+
+  while (n--) {
+    pb_tmpl_send (s, tm, "#picobot", "someone");
+    pb_out_flush (s);
+  }
+  return pb_bench_ns () - t;
+}
+
+/* Memory held by idle sessions. Each one gets a full line, which is
+ * answered and flushed, plus a partial line kept for later. Heap is
+ * measured with mallinfo2. The session table is static */
+void
+bench_idle (int n) {
+  struct mallinfo2 m0, m1;
+  int              sv[2], fd[BENCH_IDLE], i, j, out;
+
+  fflush (stdout);
+  out = dup (1);
+  dup2 (open ("/dev/null", O_WRONLY), 1); // pb_process_line traces
+  m0 = mallinfo2 ();
+  for (i = 0; i < n; i++) {
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0 ||
+	(j = pb_add_fd (sv[0])) < 0) break;
+    fd[i] = sv[1];
+    ses[j].func = pb_process_msg;
+    ses[j].nick = strdup ("bot");
+    ses[j].host = strdup ("bench");
+    ses[j].master = strdup ("pico");
+    write (sv[1], "PING :bench\r\nPING :ha", 22);
+    ses[j].func (&ses[j], NULL);
+    pb_out_flush (&ses[j]);
+  }
+  m1 = mallinfo2 ();
+  fflush (stdout);
+  dup2 (out, 1);
+  close (out);
+  printf ("%-36s %12.1f\n", "idle session: heap bytes",
+	  (double) (m1.uordblks - m0.uordblks) / i);
+  printf ("%-36s %12zu\n", "idle session: table bytes",
+	  sizeof(PB_SESSION) + sizeof(struct pollfd));
+  for (j = 0; j < MAX_CONN; j++)
+    if (ses[j].func == pb_process_msg) pd_del_index (j);
+  while (i--) close (fd[i]);
+}
+
+/* Many busy sessions through the event loop, with and without the
+ * pipeline. Each round every session gets a burst of lines and the
+ * loop runs once. Only the loop is timed, reading the replies is not.
+ * The modes alternate and the best of BENCH_TRIES runs is kept */
+static char *busy_burst =
+  ":n1!u@h JOIN #bench\r\n"
+  ":n1!u@h PRIVMSG #bench :@help\r\n"
+  "PING :bench\r\n"
+  ":srv 353 bot = #bench :a @b +c\r\n"
+  ":n1!u@h PART #bench :bye\r\n"
+  ":n2!u@h PRIVMSG #bench :@help search\r\n"
+  ":srv 318 bot x :End of /WHOIS list\r\n"
+  ":n2!u@h PRIVMSG bot :hi\r\n";
+
+long long
+bench_busy_run (int *fd, int n, int rounds) {
+  char      buf[65536];
+  long long t, total = 0;
+  int       i, len = strlen (busy_burst);
+
+  while (rounds--) {
+    for (i = 0; i < n; i++) write (fd[i], busy_burst, len);
+    t = pb_bench_ns ();
+    pb_loop_run (0);
+    total += pb_bench_ns () - t;
+    for (i = 0; i < n; i++) while (read (fd[i], buf, sizeof(buf)) > 0);
+  }
+  return total;
+}
+
+void
+bench_busy (int n, int rounds) {
+  long long t[2], b;
+  int       sv[2], fd[BENCH_BUSY], i, j, k, out, err, lines = 0;
+  char      *p;
+
+  irc_cm = pb_cmd_mng_new ();
+  pb_cmd_mng_add (irc_cm, "join", cmd_irc_join);
+  pb_cmd_mng_add (irc_cm, "part", cmd_irc_part);
+  pb_cmd_mng_add (irc_cm, "privmsg", cmd_irc_privmsg);
+  pb_cmd_mng_add (irc_cm, "353", cmd_irc_names);
+  pb_cmd_mng_add (irc_cm, "318", cmd_irc_whois);
+  bot_cm = pb_cmd_mng_new ();
+  pb_cmd_mng_add (bot_cm, "@help", cmd_bot_help);
+  bot_sec_cm = pb_cmd_mng_new ();
+  tm_welcome = tm_bye = tm_chat = tm_help = tm;
+  flood_msgs = 0;
+  for (p = busy_burst; (p = strchr (p, '\n')); p++) lines++;
+
+  for (i = 0; i < n; i++) {
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0 ||
+	(j = pb_add_fd (sv[0])) < 0) break;
+    fd[i] = sv[1];
+    ses[j].func = pb_process_msg;
+    ses[j].nick = strdup ("bot");
+    ses[j].host = strdup ("bench");
+    ses[j].master = strdup ("pico");
+    pb_chan_add (&ses[j], "#bench");
+  }
+  n = i;
+
+  fflush (stdout);
+  out = dup (1);
+  err = dup (2);
+  dup2 (open ("/dev/null", O_WRONLY), 1); // Traces
+  dup2 (1, 2);
+  for (k = 0; k < BENCH_TRIES; k++)
+    for (i = 0; i < 2; i++) {
+      pipeline = i;
+      bench_busy_run (fd, n, rounds / 10); // Warm up
+      b = bench_busy_run (fd, n, rounds);
+      if (!k || b < t[i]) t[i] = b;
+    }
+  fflush (stdout);
+  dup2 (out, 1);
+  dup2 (err, 2);
+  close (out);
+  close (err);
+
+  printf ("%-36s %12s\n", "busy sessions", "ns/line");
+  printf ("%-36s %12.1f\n", "loop: session by session",
+	  (double) t[0] / ((long long) n * rounds * lines));
+  printf ("%-36s %12.1f\n", "loop: pipeline",
+	  (double) t[1] / ((long long) n * rounds * lines));
+  for (j = 0; j < MAX_CONN; j++)
+    if (ses[j].func == pb_process_msg) pd_del_index (j);
+  while (n--) close (fd[n]);
+}
+
+int
+bench_lat_cmp (const void *a, const void *b) {
+  long long x = *(long long*) a, y = *(long long*) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* A session on TCP loopback. Returns the peer (server side) socket */
+int
+bench_lat_session (int lfd, struct sockaddr_in *a) {
+  int c, fd, i, on = 1;
+
+  if ((c = socket (AF_INET, SOCK_STREAM, 0)) < 0 ||
+      connect (c, (struct sockaddr*) a, sizeof(*a)) < 0 ||
+      (fd = accept (lfd, NULL, NULL)) < 0 || (i = pb_add_fd (fd)) < 0)
+    return -1;
+  setsockopt (c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  pb_set_blocking (fd, 0);
+  pb_lowlat_sock (fd);
+  ses[i].func = pb_process_msg;
+  ses[i].nick = strdup ("bot");
+  ses[i].host = strdup ("bench");
+  ses[i].master = strdup ("pico");
+  return c;
+}
+
+/* PING to PONG round trips through the event loop. Stores the
+ * p50, p99 and max reply latency in p (microseconds) */
+void
+bench_lat_run (int c, int n, double *p) {
+  long long *lat = malloc (sizeof(long long) * n), t;
+  char      buf[256];
+  int       i, r, len;
+
+  for (i = 0; i < n; i++) {
+    t = pb_bench_ns ();
+    if (write (c, "PING :bench\r\n", 13) != 13) break;
+    for (len = 0; !len || buf[len - 1] != '\n'; len += r)
+      if ((r = read (c, buf + len, sizeof(buf) - len)) <= 0) goto out;
+    lat[i] = pb_bench_ns () - t;
+  }
+ out:
+  qsort (lat, i, sizeof(long long), bench_lat_cmp);
+  if (p && i) {
+    p[0] = lat[i / 2] / 1000.0;
+    p[1] = lat[i * 99 / 100] / 1000.0;
+    p[2] = lat[i - 1] / 1000.0;
+  }
+  free (lat);
+}
+
+/* Reply latency with the loop in its own thread. Default mode first,
+ * then low latency mode: TCP options, spinning and, with more than
+ * one CPU, the loop and the client pinned to different CPUs */
+void
+bench_latency (int n) {
+  struct sockaddr_in a;
+  socklen_t          alen = sizeof(a);
+  pthread_t          loop;
+  cpu_set_t          set;
+  double             p[2][3] = {{0}};
+  int                lfd, c0, c1, out, i;
+
+  if ((lfd = pb_server (0)) < 0) return;
+  getsockname (lfd, (struct sockaddr*) &a, &alen);
+  a.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  c0 = bench_lat_session (lfd, &a);
+  lowlat = 1; // Socket options for the second session
+  lowlat_spin = BENCH_SPIN;
+  c1 = bench_lat_session (lfd, &a);
+  lowlat = 0;
+  close (lfd);
+  if (c0 < 0 || c1 < 0) return;
+
+  fflush (stdout);
+  out = dup (1);
+  dup2 (open ("/dev/null", O_WRONLY), 1); // pb_process_line traces
+  pthread_create (&loop, NULL, pb_loop, NULL);
+  bench_lat_run (c0, n / 10, NULL); // Warm up
+  bench_lat_run (c0, n, p[0]);
+
+  lowlat = 1;
+  if (sysconf (_SC_NPROCESSORS_ONLN) > 1) {
+    lowlat_cpu[n_lowlat_cpu++] = 1;
+    pb_lowlat_pin (loop, 0);
+    CPU_ZERO (&set);
+    CPU_SET (0, &set);
+    sched_setaffinity (0, sizeof(set), &set);
+  }
+  bench_lat_run (c1, n / 10, NULL);
+  bench_lat_run (c1, n, p[1]);
+  running = 0;
+  pthread_join (loop, NULL);
+  fflush (stdout);
+  dup2 (out, 1);
+  close (out);
+
+  printf ("%-36s %12s %8s %8s\n", "reply latency (us)", "p50", "p99", "max");
+  for (i = 0; i < 2; i++)
+    printf ("%-36s %12.1f %8.1f %8.1f\n", i ? "latency: low latency mode" :
+	    "latency: default", p[i][0], p[i][1], p[i][2]);
+}
+
+static BENCH bench[] = {
+  {"reply: printf (old, write)", bench_printf_old},
+  {"reply: printf -> queue", bench_printf},
+  {"reply: template -> queue", bench_tmpl},
+  {"reply: printf -> queue + flush", bench_printf_flush},
+  {"reply: template -> queue + flush", bench_tmpl_flush},
+  {NULL, NULL}
+};
+
+int
+main (int argc, char *argv[]) {
+  PB_SESSION *s;
+  long long  t;
+  int        i, n = BENCH_N;
+
+  if (argc > 1) n = atoi (argv[1]);
+  for (i = 0; i < MAX_CONN; i++) ses[i].fd = pfd[i].fd = -1;
+  if ((i = pb_add_fd (open ("/dev/null", O_WRONLY))) < 0) exit (1);
+  s = &ses[i];
+  tm = pb_tmpl_new ("PRIVMSG %s :Welcome %s\n");
+
+  printf ("%-36s %12s\n", "benchmark", "ns/op");
+  for (i = 0; bench[i].name; i++) {
+    bench[i].f (s, n / 10); // Warm up
+    t = bench[i].f (s, n);
+    printf ("%-36s %12.1f\n", bench[i].name, (double) t / n);
+  }
+  bench_idle (BENCH_IDLE);
+  pd_del_index (s - ses);
+  bench_busy (BENCH_BUSY, BENCH_ROUNDS);
+  bench_latency (BENCH_LAT);
+
+  return 0;
+}
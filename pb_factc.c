@@ -0,0 +1,138 @@
+/*
+ * picoBot: A Educational IRC Bot
+ * Copyright (c) 2017 pico
+ *
+ * This file is part of picoBot
+ *
+ * picoBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picoBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picoBot.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* picoBot factoid compiler. Builds the database the bot maps from a
+ * text file with one "key<TAB>value" per line. Lines starting with
+ * '#' are comments. For duplicated keys the first one wins.
+ * The bot is built in without its main to share the file format */
+#define PB_NO_MAIN
+#include "picobot4.c"
+
+typedef struct fc_fact_t {
+  char *key;   // Folded
+  char *val;
+  int  line;
+} FC_FACT;
+
+// By key and then by line, so the first of duplicated keys stays
+int
+fc_cmp (const void *a, const void *b) {
+  int c = strcmp (((FC_FACT*) a)->key, ((FC_FACT*) b)->key);
+
+  return c ? c : ((FC_FACT*) a)->line - ((FC_FACT*) b)->line;
+}
+
+int
+main (int argc, char *argv[]) {
+  FILE        *f;
+  FC_FACT     *fc = NULL, *aux;
+  PB_FACT_HDR *hdr;
+  PB_FACT_ENT *e;
+  char        *line = NULL, *val, key[PB_FACT_KEY];
+  size_t      lsize = 0;
+  uint64_t    off;
+  int         n = 0, size = 0, i, j, l = 0, len;
+
+  if (argc != 3) {
+    fprintf (stderr, "Usage: %s facts.txt facts.fdb\n", argv[0]);
+    return 1;
+  }
+  if ((f = fopen (argv[1], "r")) == NULL) {
+    perror (argv[1]);
+    return 1;
+  }
+  while ((len = getline (&line, &lsize, f)) > 0) {
+    l++;
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = 0;
+    if (!len || line[0] == '#') continue;
+    if ((val = strchr (line, '\t')) == NULL) {
+      fprintf (stderr, "E: %s:%d: No TAB after the key\n", argv[1], l);
+      continue;
+    }
+    *val++ = 0;
+    if (strlen (line) >= PB_FACT_KEY) {
+      fprintf (stderr, "E: %s:%d: Key too long\n", argv[1], l);
+      continue;
+    }
+    if (strlen (val) > PB_FACT_VAL) {
+      fprintf (stderr, "W: %s:%d: Value truncated to %d bytes\n",
+	       argv[1], l, PB_FACT_VAL);
+      val[PB_FACT_VAL] = 0;
+    }
+    if (n == size) {
+      size = size ? size * 2 : 1024;
+      if ((aux = realloc (fc, sizeof(FC_FACT) * size)) == NULL) {
+	perror ("realloc:");
+	return 1;
+      }
+      fc = aux;
+    }
+    pb_fact_fold (key, line);
+    fc[n].key = strdup (key);
+    fc[n].val = strdup (val);
+    fc[n++].line = l;
+  }
+  fclose (f);
+  free (line);
+
+  qsort (fc, n, sizeof(FC_FACT), fc_cmp);
+  for (i = j = 0; i < n; i++) {
+    if (j && !strcmp (fc[j - 1].key, fc[i].key)) continue;
+    fc[j++] = fc[i];
+  }
+  n = j;
+
+  // Header and entries in memory. Strings are written as we go
+  if ((f = fopen (argv[2], "w")) == NULL) {
+    perror (argv[2]);
+    return 1;
+  }
+  hdr = calloc (1, sizeof(PB_FACT_HDR));
+  e = calloc (n + 1, sizeof(PB_FACT_ENT));
+  hdr->magic = PB_FACT_MAGIC;
+  hdr->n = n;
+  off = sizeof(PB_FACT_HDR) + (uint64_t) n * sizeof(PB_FACT_ENT);
+  for (i = 0, j = 0; i < n; i++) {
+    for (; j <= pb_fact_fence (fc[i].key); j++) hdr->fence[j] = i;
+    strncpy (e[i].pfx, fc[i].key, sizeof(e[i].pfx));
+    e[i].key = off;
+    off += strlen (fc[i].key) + 1;
+    e[i].val = off;
+    off += strlen (fc[i].val) + 1;
+  }
+  for (; j <= 65536; j++) hdr->fence[j] = n;
+  if (off > UINT32_MAX) {
+    fprintf (stderr, "E: Database over 4GB\n");
+    return 1;
+  }
+  fwrite (hdr, sizeof(PB_FACT_HDR), 1, f);
+  fwrite (e, sizeof(PB_FACT_ENT), n, f);
+  for (i = 0; i < n; i++) {
+    fwrite (fc[i].key, 1, strlen (fc[i].key) + 1, f);
+    fwrite (fc[i].val, 1, strlen (fc[i].val) + 1, f);
+  }
+  if (fclose (f)) {
+    perror (argv[2]);
+    return 1;
+  }
+  printf ("%d factoids. %llu bytes\n", n, (unsigned long long) off);
+  return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ * picoBot: A Educational IRC Bot
+ * Copyright (c) 2017 pico
+ *
+ * This file is part of picoBot
+ *
+ * picoBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picoBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picoBot.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* picoBot regression suite. Fixed IRC corpora go through the stages
+ * of a line: pb_irc_msg_parse, pb_cmd_mng_run (the handlers) and
+ * pb_printf. For each stage and corpus it reports ns/msg (best of
+ * REGRESS_TRIES) and allocations/msg, and compares them with a
+ * baseline file. It fails if a stage is slower than the baseline by
+ * more than the threshold or allocates more. Each try also times a
+ * fixed calibration loop, and the baseline is scaled by how it did, so
+ * a machine that is slower for a while does not fail the suite. A
+ * stage that still looks slower is measured again. Timings depend on
+ * the machine: write the baseline where the suite runs (-w) */
+#define PB_NO_MAIN
+#include "picobot4.c"
+
+#define REGRESS_MSGS   20000  // Messages per try and stage
+#define REGRESS_TRIES  7
+#define REGRESS_THR    25     // Percent slower to fail
+#define REGRESS_RETRY  2      // Measures again a stage that looks slower
+#define REGRESS_MAX    64     // Lines per corpus
+#define REGRESS_NICKS  60     // Nicks per NAMES line
+
+typedef struct regress_corpus_t {
+  char *name;
+  char *line[REGRESS_MAX];
+  int  n;
+} REGRESS_CORPUS;
+
+typedef struct regress_res_t {
+  char   stage[16], corpus[16];
+  double ns, allocs;
+  double calib;  // ns per calibration op in the same tries
+} REGRESS_RES;
+
+/* Allocations are counted for the whole process. glibc exports the
+ * real allocator, so these just count and forward */
+static long regress_allocs = 0;
+
+void *__libc_malloc (size_t size);
+void *__libc_calloc (size_t n, size_t size);
+void *__libc_realloc (void *p, size_t size);
+
+void *
+malloc (size_t size) {
+  regress_allocs++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size) {
+  regress_allocs++;
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *p, size_t size) {
+  regress_allocs++;
+  return __libc_realloc (p, size);
+}
+
+static char long_text[400];
+static char names[4][BSIZE];
+
+static REGRESS_CORPUS corpus[] = {
+  {"chatter", {
+      ":n1!u@h JOIN #bench",
+      ":n1!u@h PRIVMSG #bench :hi all",
+      ":n2!u@h PRIVMSG #bench :hey n1",
+      ":n1!u@h PRIVMSG #bench :@help",
+      ":n3!u@h JOIN :#bench",
+      ":n3!u@h PRIVMSG #bench :lol",
+      ":n2!u@h PRIVMSG #bench :\001ACTION waves\001",
+      ":n2!u@h PRIVMSG bot :hi",
+      ":n3!u@h NICK :n4",
+      ":n1!u@h PART #bench :bye",
+      ":n4!u@h QUIT :Quit: leaving",
+      NULL}},
+  {"long", {0}},       // Built by regress_init
+  {"names", {0}},
+  {"malformed", {
+      "",
+      ":",
+      ":n1!u@h",
+      ":n1!u@h ",
+      "@time=2017-01-01T00:00:00.000Z",
+      "@a=b;c=d :n1!u@h PRIVMSG #bench :tagged",
+      "     ",
+      "PRIVMSG",
+      ":n1!u@h PRIVMSG",
+      ":n1!u@h PRIVMSG #bench",
+      ":n1!u@h PRIVMSG #bench :",
+      ":n1!u@h PRIVMSG  #bench  ::@help",
+      ":n1!u@h FOO bar baz",
+      ":srv 353 bot",
+      ":srv 353 bot = #nochan :a b c",
+      ":srv 318",
+      "JOIN",
+      ":n1!u@h JOIN",
+      ":n1!u@h KICK #bench",
+      "CMD a b c d e f g h i j k l m n o p q r s t u v w x y z 1 2 3 4 5 6",
+      NULL}},
+  {NULL}
+};
+
+long long
+regress_ns (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Corpora that are generated. The same every run
+void
+regress_init (void) {
+  REGRESS_CORPUS *c;
+  int            i, j, len;
+
+  for (i = 0; i < sizeof(long_text) - 1; i++) long_text[i] = 'a' + i % 26;
+  for (i = 40; i < sizeof(long_text) - 1; i += 7) long_text[i] = ' ';
+  c = &corpus[1];
+  c->line[0] = ":n1!u@h PRIVMSG #bench :%s";
+  c->line[1] = ":n2!u@h PRIVMSG bot :%s";
+  c->line[2] = ":n3!u@h NOTICE #bench :%s";
+  c->line[3] = ":n1!u@h PART #bench :%s";
+  c->line[4] = ":n1!u@h JOIN #bench";
+  c->line[5] = ":n2!u@h PRIVMSG #bench :@help %s";
+  for (i = 0; i < 6; i++)
+    if (strstr (c->line[i], "%s")) asprintf (&c->line[i], c->line[i], long_text);
+
+  c = &corpus[2];
+  for (i = 0; i < 4; i++) {
+    len = snprintf (names[i], BSIZE, ":srv 353 bot = #bench :");
+    for (j = 0; j < REGRESS_NICKS; j++)
+      len += snprintf (names[i] + len, BSIZE - len, "%sn%03d ",
+		       j % 7 == 0 ? "@" : j % 5 == 0 ? "+" : "",
+		       i * REGRESS_NICKS + j);
+    c->line[i] = names[i];
+  }
+  c->line[4] = ":srv 366 bot #bench :End of /NAMES list.";
+  c->line[5] = ":srv 311 bot n001 u h * :Real Name";
+  c->line[6] = ":srv 318 bot n001 :End of /WHOIS list";
+
+  for (c = corpus; c->name; c++) for (c->n = 0; c->line[c->n]; c->n++);
+}
+
+// Formats and hashes a reply. Work like the stages, but fixed
+long long
+regress_calib (void) {
+  char         buf[128];
+  unsigned int h = 2166136261u;
+  long long    t = regress_ns ();
+  int          i, j, len;
+
+  for (i = 0; i < REGRESS_MSGS; i++) {
+    len = snprintf (buf, sizeof(buf), "PRIVMSG %s :%s %d\n", "#bench", "calibration", i);
+    for (j = 0; j < len; j++) h = (h ^ buf[j]) * 16777619u;
+  }
+  t = regress_ns () - t;
+  return t + (h == 1); // Keeps the hash
+}
+
+/* Each rep parses the corpus again, as the handlers change the lines.
+ * Only the stage is timed and counted */
+enum {REGRESS_PARSE, REGRESS_CMD, REGRESS_PRINTF};
+
+void
+regress_stage (PB_SESSION *s, REGRESS_CORPUS *c, int stage, REGRESS_RES *r) {
+  PB_IRC_MSG m[REGRESS_MAX];
+  long long  t, ct, best = 0, best_c = 0;
+  long       a = 0;
+  int        k, rep, i, n = 0, reps = REGRESS_MSGS / c->n + 1;
+
+  for (k = 0; k <= REGRESS_TRIES; k++) { // First one warms up
+    ct = regress_calib ();
+    if (k == 1 || (k > 1 && ct < best_c)) best_c = ct;
+    for (rep = 0, t = 0, n = 0; rep < reps; rep++) {
+      memset (m, 0, sizeof(m));
+      if (stage == REGRESS_PARSE) {
+	a -= regress_allocs;
+	t -= regress_ns ();
+	for (i = 0; i < c->n; i++) {
+	  m[i].raw = c->line[i];
+	  pb_irc_msg_parse (&m[i], c->line[i]);
+	  pb_irc_msg_free (&m[i]);
+	}
+	t += regress_ns ();
+	a += regress_allocs;
+	n += c->n;
+	continue;
+      }
+      for (i = 0; i < c->n; i++) {
+	m[i].raw = c->line[i];
+	if (pb_irc_msg_parse (&m[i], c->line[i]) < 0) m[i].cmd = NULL;
+      }
+      a -= regress_allocs;
+      t -= regress_ns ();
+      for (i = 0; i < c->n; i++) {
+	if (!m[i].cmd) continue;
+	if (stage == REGRESS_CMD) pb_cmd_mng_run (irc_cm, s, m[i].cmd, &m[i]);
+	else pb_printf (s, "PRIVMSG %s :%s\n", m[i].to ? m[i].to : "*",
+			m[i].pars ? m[i].pars : "");
+	s->ooff = s->olen = 0;
+	n++;
+      }
+      t += regress_ns ();
+      a += regress_allocs;
+      for (i = 0; i < c->n; i++) pb_irc_msg_free (&m[i]);
+    }
+    if (k == 1 || (k > 1 && t < best)) best = t;
+    if (k < REGRESS_TRIES) a = 0;
+  }
+  strcpy (r->stage, stage == REGRESS_PARSE ? "parse" : stage == REGRESS_CMD ?
+	  "cmd" : "printf");
+  snprintf (r->corpus, sizeof(r->corpus), "%s", c->name);
+  r->ns = n ? (double) best / n : 0;
+  r->allocs = n ? (double) a / n : 0;
+  r->calib = (double) best_c / REGRESS_MSGS;
+}
+
+int
+regress_base_load (char *path, REGRESS_RES *b, int max) {
+  FILE *f;
+  char line[256];
+  int  n = 0;
+
+  if ((f = fopen (path, "r")) == NULL) return -1;
+  while (n < max && fgets (line, sizeof(line), f)) {
+    if (line[0] == '#') continue;
+    b[n].calib = 0;
+    if (sscanf (line, "%15s %15s %lf %lf %lf", b[n].stage, b[n].corpus,
+		&b[n].ns, &b[n].allocs, &b[n].calib) >= 4) n++;
+  }
+  fclose (f);
+  return n;
+}
+
+REGRESS_RES *
+regress_base_find (REGRESS_RES *base, int n, REGRESS_RES *r) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (!strcmp (base[i].stage, r->stage) && !strcmp (base[i].corpus, r->corpus))
+      return &base[i];
+  return NULL;
+}
+
+// Baseline time at the machine speed of r
+double
+regress_expect (REGRESS_RES *r, REGRESS_RES *b) {
+  return b->calib > 0 && r->calib > 0 ? b->ns * r->calib / b->calib : b->ns;
+}
+
+int
+regress_slower (REGRESS_RES *r, REGRESS_RES *b, int thr) {
+  return b && r->ns > regress_expect (r, b) * (100 + thr) / 100;
+}
+
+int
+main (int argc, char *argv[]) {
+  REGRESS_RES    res[16], base[16], again, *b;
+  REGRESS_CORPUS *c;
+  PB_SESSION     *s;
+  FILE           *f;
+  char           *path = NULL;
+  double         e;
+  int            i, j, n = 0, n_base = 0, thr = REGRESS_THR, write_base = 0;
+  int            out, err, k, fail = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp (argv[i], "-w")) write_base = 1;
+    else if (!strcmp (argv[i], "-t") && i + 1 < argc) thr = atoi (argv[++i]);
+    else path = argv[i];
+  }
+  if (!path || (!write_base && (n_base = regress_base_load (path, base, 16)) < 0)) {
+    fprintf (stderr, "Usage: %s [-t percent] baseline | -w baseline\n", argv[0]);
+    return 2;
+  }
+
+  for (i = 0; i < MAX_CONN; i++) ses[i].fd = pfd[i].fd = -1;
+  if ((i = pb_add_fd (open ("/dev/null", O_WRONLY))) < 0) exit (1);
+  s = &ses[i];
+  s->func = pb_process_msg;
+  s->nick = strdup ("bot");
+  s->host = strdup ("regress");
+  s->master = strdup ("pico");
+  pb_cmds_init ();
+  pb_chan_add (s, "#bench");
+  flood_msgs = 0; // Depends on the clock
+  regress_init ();
+
+  fflush (stdout);
+  out = dup (1);
+  err = dup (2);
+  dup2 (open ("/dev/null", O_WRONLY), 1); // Traces
+  dup2 (1, 2);
+  for (c = corpus; c->name; c++)
+    for (j = REGRESS_PARSE; j <= REGRESS_PRINTF; j++, n++) {
+      regress_stage (s, c, j, &res[n]);
+      b = regress_base_find (base, n_base, &res[n]);
+      for (k = 0; k < REGRESS_RETRY && regress_slower (&res[n], b, thr); k++) {
+	regress_stage (s, c, j, &again);
+	if (again.ns / again.calib < res[n].ns / res[n].calib) res[n] = again;
+      }
+    }
+  fflush (stdout);
+  dup2 (out, 1);
+  dup2 (err, 2);
+  close (out);
+  close (err);
+
+  if (write_base) {
+    if ((f = fopen (path, "w")) == NULL) {
+      perror (path);
+      return 2;
+    }
+    fprintf (f, "# stage corpus ns/msg allocs/msg calib_ns\n");
+    for (i = 0; i < n; i++)
+      fprintf (f, "%s %s %.1f %.2f %.2f\n", res[i].stage, res[i].corpus,
+	       res[i].ns, res[i].allocs, res[i].calib);
+    fclose (f);
+  }
+
+  // The expected time is the baseline scaled by the calibration
+  printf ("%-8s %-10s %10s %10s %7s %10s %10s\n", "stage", "corpus",
+	  "ns/msg", "expected", "diff%", "allocs/msg", "base");
+  for (i = 0; i < n; i++) {
+    b = regress_base_find (base, n_base, &res[i]);
+    printf ("%-8s %-10s %10.1f", res[i].stage, res[i].corpus, res[i].ns);
+    if (!b) {
+      printf (" %10s %7s %10.2f %10s\n", "-", "-", res[i].allocs, "-");
+      continue;
+    }
+    e = regress_expect (&res[i], b);
+    printf (" %10.1f %+7.1f %10.2f %10.2f", e, e ? 100 * (res[i].ns - e) / e : 0,
+	    res[i].allocs, b->allocs);
+    if (regress_slower (&res[i], b, thr) || res[i].allocs > b->allocs + 0.005) {
+      printf ("  REGRESSION");
+      fail = 1;
+    }
+    printf ("\n");
+  }
+  if (write_base) printf ("Baseline written to %s\n", path);
+  else printf ("%s (threshold %d%%)\n", fail ? "FAILED" : "OK", thr);
+  return fail;
+}
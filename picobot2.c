@@ -34,18 +34,33 @@
 #define BSIZE        4096
 #define MAX_CONN     32
 #define PB_TMO       500 // miliseconds
+#define PB_NAME      64  // Nick, host and master length
 
+/* This version does no heap allocations once running. Sessions and
+ * their buffers are in a static table, lines are parsed in place and
+ * the commands are constant tables */
 struct pb_session_t;
 typedef int (*PROC_MSG) (struct pb_session_t *, char *);
 
 typedef struct pb_session_t {
-  char     *nick;
-  char     *host;
-  char     *master;
+  char     nick[PB_NAME];
+  char     host[PB_NAME];
+  char     master[PB_NAME];
   int      fd;
   PROC_MSG func;
+  char     rbuf[BSIZE];  // Partial line from the last read
+  int      rlen;
 } PB_SESSION;
 
+typedef struct pb_irc_msg_t {
+  char *from, *cmd, *to, *pars;
+} PB_IRC_MSG;
+
+typedef struct pb_cmd_t {
+  char *id;
+  int  (*f) (PB_SESSION *s, PB_IRC_MSG *m, char *buffer);
+} PB_CMD;
+
 static  char           *my_key= "KillerBot";
 static  PB_SESSION     ses[MAX_CONN];
 static  struct pollfd  pfd[MAX_CONN];
@@ -74,13 +89,17 @@ pd_del_index (int i) {
   pfd[i].fd = -1;
   close (ses[i].fd);
   ses[i].fd = -1;
-  if (ses[i].host) free (ses[i].host);
-  if (ses[i].nick) free (ses[i].nick);
-  if (ses[i].master) free (ses[i].master);
+  ses[i].host[0] = ses[i].nick[0] = ses[i].master[0] = 0;
+  ses[i].rlen = 0;
 
   return i; 
 }
 
+void
+pb_set (char *field, char *val) {
+  snprintf (field, PB_NAME, "%s", val);
+}
+
 int
 pd_del_fd (int fd) {
   int i;
@@ -113,10 +132,9 @@ pb_printf (PB_SESSION *s, char *fmt,...) {
 
   va_start (arg, fmt);
   
-  memset (buf, 0, BSIZE);
-  if ((len = vsnprintf (buf, BSIZE, fmt, arg)) > BSIZE) {
+  if ((len = vsnprintf (buf, BSIZE, fmt, arg)) >= BSIZE) {
     fprintf (stderr, "Output truncated!!!\n");
-    buf[BSIZE - 1] = 0;
+    len = BSIZE - 1;
   }
   len = write (s->fd, buf, len);
   va_end (arg);
@@ -157,6 +175,41 @@ pb_server (int port) {
   return -1;
 }
 
+/* Numeric addresses are used as they are. Names go through
+ * getaddrinfo, that allocates memory */
+int
+pb_connect_numeric (char *host, char *port) {
+  struct sockaddr_in6 a6;
+  struct sockaddr_in  a4;
+  struct sockaddr     *a;
+  socklen_t           len;
+  int                 sfd;
+
+  memset (&a4, 0, sizeof(a4));
+  memset (&a6, 0, sizeof(a6));
+  if (inet_pton (AF_INET, host, &a4.sin_addr) == 1) {
+    a4.sin_family = AF_INET;
+    a4.sin_port = htons (atoi (port));
+    a = (struct sockaddr*) &a4;
+    len = sizeof(a4);
+  }
+  else if (inet_pton (AF_INET6, host, &a6.sin6_addr) == 1) {
+    a6.sin6_family = AF_INET6;
+    a6.sin6_port = htons (atoi (port));
+    a = (struct sockaddr*) &a6;
+    len = sizeof(a6);
+  }
+  else return -2;
+
+  if ((sfd = socket (a->sa_family, SOCK_STREAM, 0)) < 0) return -1;
+  if (connect (sfd, a, len) < 0) {
+    fprintf (stderr, "Cannot connect to host '%s'\n", host);
+    close (sfd);
+    return -1;
+  }
+  return sfd;
+}
+
 int 
 pb_connect (char *host, char* port) {
   struct addrinfo hints;
@@ -166,6 +219,7 @@ pb_connect (char *host, char* port) {
   if (!host) return -1;
   if (!port) return -1;
   printf ("Connecting to '%s':%s\n", host, port);
+  if ((sfd = pb_connect_numeric (host, port)) != -2) return sfd;
   
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
@@ -184,6 +238,7 @@ pb_connect (char *host, char* port) {
   }
   if (rp == NULL) {
     fprintf (stderr, "Cannot connect to host '%s'\n", host);
+    freeaddrinfo(result); 
     return -1;
   }
   freeaddrinfo(result); 
@@ -197,7 +252,7 @@ pb_irc_register (PB_SESSION *s, char *nick, char *desc) {
   if (!nick) return -1;
   if (!desc) return -1;
   
-  s->nick = strdup (nick);
+  pb_set (s->nick, nick);
   pb_printf (s, "user %s  0 *: %s\n", nick, desc);
   pb_printf (s, "nick %s\n", nick);
   
@@ -213,98 +268,164 @@ pb_irc_join (PB_SESSION *s, char *channel) {
   return 0;
 }
 
+/* IRC messages. ":from!user@host cmd to :pars" parsed in place */
 int
-pb_process_msg (PB_SESSION *s, char *buffer1) {
-  char *prefix, *cmd, *from, *to, *aux, *pars = NULL; 
-  char buffer[BSIZE];
+cmd_irc_join (PB_SESSION *s, PB_IRC_MSG *m, char *buffer) {
+  if (!strncmp (m->from, s->nick, strlen(s->nick))) return 0;
+  pb_printf (s, "PRIVMSG %s :Welcome %s\n", m->pars ? m->pars : m->to, m->from);
+  if (!strncmp (m->from, s->master, strlen(s->master)))
+    pb_printf (s, "PRIVMSG %s :Glad to see you again Master. My key is %s\n", s->master, my_key);
+  return 0;
+}
 
-  memset (buffer, 0, BSIZE);
-  if (read(s->fd, buffer, BSIZE) <= 0) return -1;
-  printf ("< %s", buffer);
+int
+cmd_irc_part (PB_SESSION *s, PB_IRC_MSG *m, char *buffer) {
+  pb_printf (s, "PRIVMSG %s :Bye %s\n", m->to, m->from);
+  return 0;
+}
 
-  
+int
+cmd_irc_privmsg (PB_SESSION *s, PB_IRC_MSG *m, char *buffer) {
+  if (! strncasecmp (m->from, s->nick, strlen(s->nick))) return 0;
+  if (!m->to || !m->pars) return 0;
+  if (m->to[0] == '#') {
+    if (!strncasecmp (m->pars, "@help", 5))
+      pb_printf (s, "PRIVMSG %s :Cannot help you %s. I'm Under Development. Sorry about that\n", m->to, m->from);
+  } else {
+    if (!strncmp (m->from, s->master, strlen(s->master)) && 
+	!strncasecmp (m->pars, my_key, strlen(my_key))) {
+      pb_printf (s, "PRIVMSG %s :Ready master. Running cmd '%s'\n", m->from, m->pars + strlen (my_key)+1);
+      if (!strncasecmp (m->pars + strlen (my_key)+1, "@quit", 5))
+	{
+	  pb_printf (s, "PRIVMSG %s :Bye\n", m->from);
+	  pd_del_fd (s->fd);
+	}
+    }
+  }
+  return 0;
+}
+
+static const PB_CMD irc_cmd[] = {
+  {"JOIN", cmd_irc_join},
+  {"PART", cmd_irc_part},
+  {"PRIVMSG", cmd_irc_privmsg},
+  {NULL, NULL}
+};
+
+int
+pb_process_line (PB_SESSION *s, char *buffer) {
+  PB_IRC_MSG   m = {"", NULL, NULL, NULL};
+  const PB_CMD *c;
+  char         *p = buffer, *aux;
+
+  printf ("< %s\n", buffer);
   if (!strncasecmp (buffer, "ping", 4)) {
     pb_printf (s, "PONG\n");
     return 0;
   }
-  
-  if (buffer[0] == ':') { // Process Prefix 
-    prefix = strtok (buffer, " ");
-    cmd = strtok (NULL, " ");
-    to = strtok (NULL, "\r");
-    if ((aux = strchr (to, ':'))) {
+  if (*p == ':') { // Process Prefix 
+    m.from = ++p;
+    if (!(p = strchr (p, ' '))) return 0;
+    *p++ = 0;
+    if ((aux = strchr (m.from, '!'))) *aux = 0;
+  }
+  m.cmd = p;
+  if ((p = strchr (p, ' '))) {
+    *p++ = 0;
+    if (*p != ':') m.to = p;
+    if ((aux = strchr (p, ':'))) {
       *aux++ = 0;
-      pars = strdup (aux);
+      m.pars = aux;
     }
-    from = strtok (prefix + 1, "!");
+    if (m.to && (aux = strchr (m.to, ' '))) *aux = 0;
   }
-  
-  if (!strncasecmp (cmd, "JOIN", 4) && strncmp (from, s->nick, strlen(s->nick))) {
-    pb_printf (s, "PRIVMSG %s :Welcome %s\n", pars, from);
-    if (!strncmp (from, s->master, strlen(s->master)))
-      pb_printf (s, "PRIVMSG %s :Glad to see you again Master. My key is %s\n", s->master, my_key);
+  for (c = irc_cmd; c->id; c++)
+    if (!strncasecmp (m.cmd, c->id, strlen (c->id))) return c->f (s, &m, buffer);
+  return 0;
+}
+
+/* Reads into the session buffer and processes the complete lines */
+int
+pb_process_msg (PB_SESSION *s, char *buffer1) {
+  char *p, *e;
+  int  r;
+
+  if ((r = read (s->fd, s->rbuf + s->rlen, BSIZE - 1 - s->rlen)) <= 0) return -1;
+  s->rlen += r;
+  s->rbuf[s->rlen] = 0;
+  for (p = s->rbuf; (e = strchr (p, '\n')); p = e + 1) {
+    *e = 0;
+    if (e > p && e[-1] == '\r') e[-1] = 0;
+    if (*p) pb_process_line (s, p);
+    if (s->fd == -1) return 0; // Closed by a command
   }
-  else   if (!strncasecmp (cmd, "PART", 4))
-    pb_printf (s, "PRIVMSG %s :Bye %s\n", to, from);
-  else if (!strncasecmp (cmd, "PRIVMSG", 7)) {
-    if (! strncasecmp (from, s->nick, strlen(s->nick))) return 0;
-    if (to[0] == '#') {
-      if (!strncasecmp (pars, "@help", 5))
-	pb_printf (s, "PRIVMSG %s :Cannot help you %s. I'm Under Development. Sorry about that\n", to, from);
-    } else {
-      if (!strncmp (from, s->master, strlen(s->master)) && 
-	  !strncasecmp (pars, my_key, strlen(my_key))) {
-	pb_printf (s, "PRIVMSG %s :Ready master. Running cmd '%s'\n", from, pars + strlen (my_key)+1);
-	if (!strncasecmp (pars + strlen (my_key)+1, "@quit", 5))
-	  {
-	    pb_printf (s, "PRIVMSG %s :Bye\n", from);
-	    pd_del_fd (s->fd);
-
-	  }
-      }
-      
-    }
+  if ((s->rlen = s->rbuf + s->rlen - p) == BSIZE - 1) {
+    fprintf (stderr, "E: Line too long. Dropped\n");
+    s->rlen = 0;
   }
+  memmove (s->rbuf, p, s->rlen);
+  return 0;
+}
+
+/* Control channel commands */
+int
+cmd_ctrl_help (PB_SESSION *s, PB_IRC_MSG *m, char *buffer) {
+  pb_printf (s, "< Command list:\n< connect host nick channel master\n< list\n< quit\n");
+  return 0;
+}
+
+int
+cmd_ctrl_quit (PB_SESSION *s, PB_IRC_MSG *m, char *buffer) {
+  pd_del_fd (s->fd);
+  return 0;
+}
+
+int
+cmd_ctrl_list (PB_SESSION *s, PB_IRC_MSG *m, char *buffer) {
+  int i;
+
+  for (i = 0; i < MAX_CONN; i++)
+    if (ses[i].fd != -1) pb_printf (s, "< [%s@%s]\t : Master <%s>\n",
+				    ses[i].nick, ses[i].host, ses[i].master);	      
   return 0;
 }
 
+int
+cmd_ctrl_connect (PB_SESSION *s, PB_IRC_MSG *m, char *buffer) {
+  char host[1024], nick[1024], channel[1024], master[1024];
+
+  if (sscanf (buffer + strlen("connect "), "%1023s %1023s %1023s %1023s", 
+	      host, nick, channel, master) != 4 ||
+      pb_add_session (host, nick, channel, master) < 0)
+    pb_printf (s, "< Cannot initiate instance\n");
+  else
+    pb_printf (s, "< Bot instance '%s@%s' running\n", nick, host);
+  return 0;
+}
+
+static const PB_CMD ctrl_cmd[] = {
+  {"help", cmd_ctrl_help},
+  {"quit", cmd_ctrl_quit},
+  {"list", cmd_ctrl_list},
+  {"connect", cmd_ctrl_connect},
+  {NULL, NULL}
+};
 
 int
 proc_ctrl_msg (PB_SESSION *s, char *buffer1) {
- char buffer[BSIZE];
- int  i;
+  const PB_CMD *c;
+  int          r;
 
-  memset (buffer, 0, BSIZE);
-  if (read(s->fd, buffer, BSIZE) <= 0) {
+  if ((r = read (s->fd, s->rbuf, BSIZE - 1)) <= 0) {
     fprintf (stderr,"I: Control Connection dropped\n");
     pd_del_fd (s->fd);
     return -1;
   }
-  printf ("< %s", buffer);
+  s->rbuf[r] = 0;
+  printf ("< %s", s->rbuf);
 
-  if (!strncasecmp (buffer, "help", strlen("help"))) {
-      pb_printf (s, "< Command list:\n< connect host nick channel master\n< list\n< quit\n");
-    }
-  else if (!strncasecmp (buffer, "quit", strlen("quit"))) {
-      pd_del_fd (s->fd);
-    }
-  else if (!strncasecmp (buffer, "list", strlen("list"))) {
-    for (i = 0; i < MAX_CONN; i++)
-      if (ses[i].fd != -1) pb_printf (s, "< [%s@%s]\t : Master <%s>\n",
-				      ses[i].nick, ses[i].host, ses[i].master);	      
-  }
-  else if (!strncasecmp (buffer, "connect", strlen("connect")))
-    {
-      char host[1024], nick[1024], channel[1024], master[1024];
-      int  fd1;
-
-      sscanf (buffer + strlen("connect "), "%s %s %s %s", 
-	      host, nick, channel, master);
-      if (pb_add_session (host, nick, channel, master) < 0)
-	pb_printf (s, "< Cannot initiate instance\n");
-      else
-	pb_printf (s, "< Bot instance '%s@host' running\n", nick, host);
-    }
+  for (c = ctrl_cmd; c->id; c++)
+    if (!strncasecmp (s->rbuf, c->id, strlen (c->id))) return c->f (s, NULL, s->rbuf);
   return 0;
 }
 
@@ -314,7 +435,6 @@ pb_ctrl_accept (PB_SESSION *s, char *buffer) {
   struct sockaddr_in client;
   socklen_t          slen = sizeof(struct sockaddr_in);
   int                cfd, i;
-  char               name[1024];
   
   fprintf (stderr, "I: Accepting connection\n");
   if ((cfd = accept (s->fd,  (struct sockaddr*)&client, &slen)) < 0) {
@@ -322,12 +442,14 @@ pb_ctrl_accept (PB_SESSION *s, char *buffer) {
     return -1;
   }
 
-  i = pb_add_fd (cfd);
+  if ((i = pb_add_fd (cfd)) < 0) {
+    close (cfd);
+    return -1;
+  }
   ses[i].func = proc_ctrl_msg;
-  ses[i].host = strdup ("N/A");
-  ses[i].master = strdup ("N/A");
-  snprintf (name, 1024, "C&C_Client-%02d", i);
-  ses[i].nick = strdup (name);
+  pb_set (ses[i].host, "N/A");
+  pb_set (ses[i].master, "N/A");
+  snprintf (ses[i].nick, PB_NAME, "C&C_Client-%02d", i);
 
   return 0;
 }
@@ -340,10 +462,13 @@ pb_add_session (char *host, char *nick, char *channel, char *master) {
   if ((fd1 = pb_connect (host, "6667")) < 0) return -1;
     
 
-  if ((i = pb_add_fd (fd1)) < 0) return -1;
+  if ((i = pb_add_fd (fd1)) < 0) {
+    close (fd1);
+    return -1;
+  }
 
-  ses[i].host = strdup (host);
-  ses[i].master = strdup (master);
+  pb_set (ses[i].host, host);
+  pb_set (ses[i].master, master);
   ses[i].func = pb_process_msg;
 
   s = &ses[i];  
@@ -356,6 +481,19 @@ pb_add_session (char *host, char *nick, char *channel, char *master) {
   return 0;
 }
 
+// Resident and data memory of the process. For the -m flag
+void
+pb_mem_report (void) {
+  FILE *f;
+  char line[256];
+
+  if ((f = fopen ("/proc/self/status", "r")) == NULL) return;
+  while (fgets (line, sizeof(line), f))
+    if (!strncmp (line, "VmRSS", 5) || !strncmp (line, "VmHWM", 5) ||
+	!strncmp (line, "VmData", 6)) printf ("%s", line);
+  fclose (f);
+}
+
 int
 main (int argc, char *argv[]) {
   PB_SESSION     pb_s, *s;
@@ -363,8 +501,12 @@ main (int argc, char *argv[]) {
   int            i, n, r, fd1;
 
   printf ("picoBot v 0.2\n");
-  for (i = 0; i < MAX_CONN; ses[i].fd = pfd[i++].fd = -1);
-
+  for (i = 0; i < MAX_CONN; i++) ses[i].fd = pfd[i].fd = -1;
+  // Memory after startup. Before the control port, so it runs anywhere
+  if (argc > 1 && !strcmp (argv[1], "-m")) {
+    pb_mem_report ();
+    return 0;
+  }
 
   // Create control channel
   fd1 = pb_server (1337);
@@ -372,9 +514,9 @@ main (int argc, char *argv[]) {
     fprintf (stderr, "Cannot add file descriptoor\n");
     exit (1);
   }
-  ses[i].host = strdup ("localhost");
-  ses[i].nick = strdup ("C&C");
-  ses[i].master = strdup ("N/A");
+  pb_set (ses[i].host, "localhost");
+  pb_set (ses[i].nick, "C&C");
+  pb_set (ses[i].master, "N/A");
   ses[i].func = pb_ctrl_accept;
 
   while (running) {
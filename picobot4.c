@@ -17,35 +17,331 @@
  * You should have received a copy of the GNU General Public License
  * along with picoBot.  If not, see <http://www.gnu.org/licenses/>.
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <poll.h>
 
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* USDT probes (provider picobot). With <sys/sdt.h> (systemtap-sdt-dev)
+ * each probe is a nop plus a note in the ELF file. Without it they
+ * compile to nothing. See pb_*.bt */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(PB_NO_USDT)
+#include <sys/sdt.h>
+#define PB_USDT 1
+#endif
+#endif
+#ifdef PB_USDT
+#define PB_PROBE2(n, a, b)    DTRACE_PROBE2 (picobot, n, a, b)
+#define PB_PROBE3(n, a, b, c) DTRACE_PROBE3 (picobot, n, a, b, c)
+#else
+#define PB_PROBE2(n, a, b)    do {} while (0)
+#define PB_PROBE3(n, a, b, c) do {} while (0)
+#endif
+
 #define BSIZE        4096
-#define MAX_CONN     32
+#define MAX_CONN     1024
 #define PB_TMO       500 // miliseconds
+#define PB_SCRATCH   (4 * BSIZE) // Max read per session
+#define PB_LINE_MAX  (8191 + 512) // IRCv3 tags plus the message
+#define PB_RBUF_SIZE (4 * PB_SCRATCH) // Receive buffer of a loop
+#define PB_DISP_MAX  256  // Lines per dispatch batch
+#define PB_OBUF_POOL 64   // Drained output buffers kept by a loop
+
+// Connection scheduler defaults. All times in miliseconds
+#define PB_THROTTLE    2000   // Min time between connects to the same server
+#define PB_MAX_PEND    4      // Max connects in progress to the same server
+#define PB_RAMP        64     // Max connects in progress overall
+#define PB_BACKOFF_MIN 1000
+#define PB_BACKOFF_MAX 300000
+#define PB_CONN_TMO    15000  // Give up on connects taking longer
+
+#define PB_MAX_ARGS    16
+#define PB_ADMIN_HWM   65536  // Stop reading admin requests above this output
+
+// IRCv3 capabilities we request. Same order as pb_caps
+#define PB_CAP_BATCH         1
+#define PB_CAP_MULTI_PREFIX  2
+#define PB_CAP_EXTENDED_JOIN 4
+#define PB_CAP_SERVER_TIME   8
+#define PB_CAP_MESSAGE_TAGS  16
+
+enum {PB_BATCH_OTHER, PB_BATCH_NETSPLIT, PB_BATCH_NETJOIN};
+
+// Per session memory budget (bytes) and what we do when exceeded
+#define PB_MEM_SOFT    (4 * 1024 * 1024)
+#define PB_MEM_HARD    (16 * 1024 * 1024)
+#define PB_SHED_NONE   0
+#define PB_SHED_DROP   1  // Over soft budget: drop low priority replies
+#define PB_SHED_PAUSE  2  // ... and output pending: stop reading
+
+// Channel history log
+#define PB_HIST_SEG    (4 * 1024 * 1024)  // Segment size
+#define PB_HIST_EVERY  64     // Records per index entry
+#define PB_HIST_FLUSH  250    // Miliseconds between batched writes
+#define PB_HIST_MAX    25     // Max lines per query
+
+// Full-text search over the history
+#define PB_TERM_MAX    32     // Longer words are truncated
+#define PB_TFILE_MAX   64     // Max term files per channel
+#define PB_SEARCH_PAGE 5      // Results per @search reply
+#define PB_TIDX_MAGIC  0x58444954 // "TIDX"
+
+// Last-seen database
+#define PB_SEEN_SLOTS  4096   // Initial slots. Power of 2
+#define PB_SEEN_MAGIC  0x4e454553 // "SEEN"
+
+// Flood detection. Count-min sketch over a sliding window
+#define PB_FLOOD_ROWS  4
+#define PB_FLOOD_COLS  1024   // Power of 2
+#define PB_FLOOD_SLOTS 4      // Sub-windows in the window
+#define PB_FLOOD_MSGS  8      // Messages allowed per window
+#define PB_FLOOD_WIN   10000  // Window. Miliseconds
+
+// DCC SEND
+#define PB_DCC_MAX     8      // Transfers at the same time
+#define PB_DCC_TMO     60000  // Time the peer has to connect
+#define PB_DCC_CHUNK   65536  // Max bytes per sendfile
+
+// Factoid database
+#define PB_FACT_MAGIC  0x54434146 // "FACT"
+#define PB_FACT_KEY    128    // Max key length
+#define PB_FACT_VAL    400    // Max value length. Fits in an IRC line
+
+// Handlers waiting for server replies
+#define PB_AWAIT_TMO   10000  // Miliseconds
+#define PB_AWAIT_MAX   1024   // Per session
+#define PB_AWAIT_DONE  0      // Continuation results
+#define PB_AWAIT_MORE  1
+
+// WHOIS/WHO cache
+#define PB_WHOIS_TTL   300000 // Miliseconds
+#define PB_WHOIS_NEG   30000  // For nicks that do not exist
+#define PB_WHOIS_MAX   4096   // Entries per session
+
+enum {PB_WHOIS_PENDING, PB_WHOIS_OK, PB_WHOIS_NONE};
+
+// Low latency mode
+#define PB_LOWLAT_CPUS 64     // Max CPUs in the pinning list
+
+/* Event loop */
+#define PB_ARENA       (2 << 20) // Loop arena chunk. A huge page
+#define PB_OUT_IOV     64     // Max pieces per writev
+
+// Kernel TLS offload directions
+#define PB_KTLS_TX     1
+#define PB_KTLS_RX     2
 
 struct pb_session_t;
+struct pb_irc_msg_t;
 typedef int (*PROC_MSG) (struct pb_session_t *, char *);
 
+/* A handler suspended until the server replies. The continuation runs
+ * for each numeric in num about key (the parameter after our nick),
+ * after the irc_cm handlers.
+ * It gets a NULL message on timeout. state and data are the handler's
+ * to keep its place between replies. Returns PB_AWAIT_MORE to keep
+ * waiting or PB_AWAIT_DONE */
+struct pb_await_t;
+typedef int (*PB_AWAIT_F) (struct pb_session_t *, struct pb_irc_msg_t *,
+			   struct pb_await_t *);
+typedef struct pb_await_t {
+  struct pb_await_t *next;
+  char              *key;
+  char              *num;     // Space separated. Not copied
+  PB_AWAIT_F        f;
+  int               state;
+  void              *data;    // Freed with the wait
+  void              *arg;     // Not freed
+  char              *to;      // Where the command came from
+  long long         expire;
+} PB_AWAIT;
+
+/* Cached WHOIS/WHO info about a nick */
+typedef struct pb_whois_t {
+  struct pb_whois_t *next;
+  char              *nick;
+  char              *user, *host, *real, *server, *chans;
+  long              idle;     // -1 unknown
+  int               state;    // PB_WHOIS_*
+  int               stale;    // Not to be cached
+  long long         expire;   // Query timeout while pending
+} PB_WHOIS;
+
+/* DCC SEND transfer. Belongs to the listening socket and then to the
+ * connection from the peer. File data goes out with sendfile */
+typedef struct pb_dcc_t {
+  int       fd;       // File
+  char      *name;
+  char      *nick;    // Peer
+  in_addr_t peer;     // Its address if its host is numeric. 0 if not known
+  int       port;
+  off_t     size, off;
+  uint32_t  ack;      // Bytes the peer got (mod 2^32)
+  uint32_t  abuf;     // Ack being read
+  int       alen;
+  double    tok;      // Rate limit bucket. Bytes
+  long long last;     // Last refill
+  long long wake;     // Throttled until. 0 if not
+  long long expire;   // Offer valid until
+} PB_DCC;
+
+/* Admin list being streamed. Items are the sessions and then the bots
+ * waiting or off. See pb_admin_more */
+typedef struct pb_admin_list_t {
+  char id[128];  // Raw JSON value of the request
+  int  next;     // Slot, or MAX_CONN + bot index
+  int  cnt;
+} PB_ADMIN_LIST;
+
+/* A network is a server endpoint shared by several bots.
+ * Connects to it are paced so we do not get K-lined on cold start */
+typedef struct pb_net_t {
+  char            *name;
+  char            *host;
+  char            *port;
+  int             throttle;
+  int             max_pend;
+  int             pending;   // Connects in progress
+  long long       next_conn; // Earliest time for the next connect
+  struct addrinfo *ai;       // Cached resolution
+  struct addrinfo *ai_cur;   // Address to try next
+  int             tls;       // Port given as +port
+} PB_NET;
+
+enum {PB_BOT_WAIT, PB_BOT_CONNECTING, PB_BOT_RUNNING, PB_BOT_OFF};
+
+/* A bot is a nick we want to keep connected to a network */
+typedef struct pb_bot_t {
+  PB_NET    *net;
+  char      *nick;
+  char      *master;
+  char      *channel;  // Comma separated list. No '#'
+  int       state;
+  int       retries;
+  long long next_try;
+  int       idx;       // Session index while connecting/running
+} PB_BOT;
+
+/* Session state. Who is on the channels we are in */
+typedef struct pb_member_t {
+  char *nick;
+  char *account;  // From extended-join. NULL when unknown
+  char mode[8];   // Channel prefixes (all of them with multi-prefix)
+} PB_MEMBER;
+
+typedef struct pb_chan_t {
+  char      *name;
+  int       n, size;
+  PB_MEMBER *m;
+  long      mem;    // Bytes used by the members
+} PB_CHAN;
+
+/* Lines enclosed in a netsplit/netjoin BATCH are queued and applied
+ * to the session state at once when the batch ends */
+typedef struct pb_batch_item_t {
+  char   *nick;
+  char   *chan;     // netjoin only
+  char   *account;
+  char   *text;     // QUIT reason. netsplit only
+  time_t time;      // Of the message. For the seen database
+} PB_BATCH_ITEM;
+
+typedef struct pb_batch_t {
+  char          *ref;
+  int           type;
+  int           n, size;
+  PB_BATCH_ITEM *it;
+  long          mem;    // Bytes used by the items
+} PB_BATCH;
+
+/* Receive buffer of the loop. Relayed lines are queued for output as
+ * references into it, so it stays until the last of them is written */
+typedef struct pb_rbuf_t {
+  int  ref;
+  int  len;   // Bytes in use by lines waiting for dispatch
+  int  pool;  // From the arena, goes back to rb_free. Otherwise malloc'ed
+  struct pb_rbuf_t *next; // Free list
+  char data[PB_RBUF_SIZE];
+} PB_RBUF;
+
+/* Output queue data not in obuf. Goes out before obuf[off] */
+typedef struct pb_oref_t {
+  int     off;
+  char    *p;
+  int     len;
+  PB_RBUF *rb;
+} PB_OREF;
+
 typedef struct pb_session_t {
   char     *nick;
   char     *host;
   char     *master;
   int      fd;
+  unsigned gen;      // Changes when the session closes. Kept by the slot
   PROC_MSG func;
+  PB_BOT   *bot;
+  SSL      *ssl;
+  int      ktls;     // PB_KTLS_TX | PB_KTLS_RX when offloaded to the kernel
+  char     *rbuf;    // Input not yet processed (partial line)
+  int      rlen, rsize;
+  int      skip;     // Dropping a line too long, up to its '\n'
+  char     *obuf;    // Output not yet written. Data is from ooff to olen
+  int      ooff, olen, osize;
+  int      n_oref, s_oref;
+  PB_OREF  *oref;    // References queued with the output. See pb_out_ref
+  int      caps_ls;  // IRCv3 capabilities offered by the server
+  int      caps;     // IRCv3 capabilities enabled
+  int      n_chan;
+  PB_CHAN  **chan;
+  int      n_batch;
+  PB_BATCH **batch;
+  int      shed;     // Memory budget state. PB_SHED_*
+  int      dropped;  // Replies dropped while over the soft budget
+  PB_DCC   *dcc;     // DCC SEND offer or transfer
+  PB_ADMIN_LIST *alist; // Admin list being written
+  int      n_await;
+  PB_AWAIT *await;   // Suspended handlers. Oldest first
+  int      n_whois, s_whois;
+  PB_WHOIS **whois;  // WHOIS/WHO cache. Hash chains
 } PB_SESSION;
 
+typedef void (*PB_WHOIS_F) (PB_SESSION *s, PB_WHOIS *e, char *nick, char *to);
+
+/* Two linked channels. What is said in one is relayed to the other */
+typedef struct pb_relay_t {
+  PB_NET *net[2];
+  char   *chan[2];
+} PB_RELAY;
+
 typedef int (*CMD_FUNC) (PB_SESSION *, char *, void*);
 typedef struct pb_cmd_t
 {
@@ -59,53 +355,335 @@ typedef struct pb_cmd_mng_t
   PB_CMD  *cmd;
 } PB_CMD_MNG;
 
+#define PB_TMPL_SEGS   8
+typedef struct pb_tmpl_t
+{
+  char *txt;
+  int  low;        // Low priority. Dropped when shedding
+  int  n;
+  int  lit;        // Length of the literals
+  struct {
+    char *p;       // NULL for slots
+    int  len;
+  } seg[PB_TMPL_SEGS];
+} PB_TMPL;
+
+/* Index entries. One every PB_HIST_EVERY records of a segment */
+typedef struct pb_hist_idx_t
+{
+  uint32_t time;
+  uint32_t off;
+} PB_HIST_IDX;
+
+/* Postings of a term: record ids (segment << 32 | offset) in
+ * ascending order, delta coded as varints */
+typedef struct pb_post_t
+{
+  char     *term;
+  uint8_t  *p;
+  int      len, size;
+  uint32_t cnt;
+  uint64_t last;  // Last id added
+} PB_POST;
+
+/* In memory term index of the segment being written. Open addressing */
+typedef struct pb_tidx_t
+{
+  int     n, size;
+  PB_POST *t;
+} PB_TIDX;
+
+/* Term file. Indexes segments first to last. The header is followed
+ * by the entries sorted by term and then by the postings */
+typedef struct pb_tfile_hdr_t
+{
+  uint32_t magic;
+  uint32_t first, last;
+  uint32_t n;
+} PB_TFILE_HDR;
+
+typedef struct pb_tfile_ent_t
+{
+  char     term[PB_TERM_MAX];
+  uint32_t off, len;  // Postings. Offset from the start of the file
+  uint32_t cnt;
+  uint32_t pad;
+  uint64_t last;
+} PB_TFILE_ENT;
+
+typedef struct pb_hist_map_t {
+  char *p;
+  long len;
+} PB_HIST_MAP;
+
+/* Writer state of a channel log. Only the history thread uses it */
+typedef struct pb_hlog_t
+{
+  char        *key;   // network/channel
+  int         fd, ifd;
+  int         seg;
+  long        size;
+  int         cnt;    // Records in the segment
+  char        *wbuf;  // Records and index entries waiting for write
+  int         wlen, wsize;
+  PB_HIST_IDX *ibuf;
+  int         ilen, isize;
+  PB_TIDX     ti;     // Terms of segment seg. Shared with queries
+} PB_HLOG;
+
+/* Last-seen record. The database is a file with a header followed by
+ * an open addressing table of these. All of it is mmap'd */
+typedef struct pb_seen_t
+{
+  uint32_t hash;      // 0 for free slots
+  uint32_t time;
+  char     net[16];
+  char     nick[32];
+  char     chan[48];
+  char     what[8];   // privmsg, join, part or quit
+  char     text[144];
+} PB_SEEN;
+
+typedef struct pb_seen_hdr_t
+{
+  uint32_t magic;
+  uint32_t slots;
+  uint32_t used;
+  char     pad[sizeof(PB_SEEN) - 12]; // Slots stay aligned
+} PB_SEEN_HDR;
+
+/* Factoid database. Built by pb_factc and mapped read only. Entries
+ * are sorted by folded key. The fence gives the range of entries
+ * starting with each two bytes. Keys and values are NUL terminated
+ * strings after the entries. Offsets are from the start of the file */
+typedef struct pb_fact_hdr_t
+{
+  uint32_t magic;
+  uint32_t n;
+  uint32_t fence[65537];
+} PB_FACT_HDR;
+
+typedef struct pb_fact_ent_t
+{
+  char     pfx[8];   // Key prefix. Most compares end here
+  uint32_t key;
+  uint32_t val;
+} PB_FACT_ENT;
+
 typedef struct pb_irc_msg_t
 {
-  char *b, *cmd, *from, *to, *pars; 
+  char   *b, *cmd, *from, *to, *pars; 
+  char   *user;              // user@host of the prefix. NULL if none
+  char   *batch;             // IRCv3 batch reference
+  char   *raw;               // The line as received
+  time_t time;               // server-time or arrival time
+  int    argc;
+  char   *arg[PB_MAX_ARGS];  // All parameters. Trailing one is the last
 } PB_IRC_MSG;
 
+/* A line waiting in the dispatch batch, parsed in place in the loop
+ * receive buffer. PINGs are not parsed (m.cmd is NULL) */
+typedef struct pb_disp_t
+{
+  PB_SESSION *s;
+  unsigned   gen;    // Session closed by a handler if it changes
+  PB_CMD     c;      // irc_cm handler. NULL if unknown
+  PB_IRC_MSG m;
+} PB_DISP;
+
 static  PB_CMD_MNG     *ctrl_cm = NULL;
 static  PB_CMD_MNG     *irc_cm = NULL;
 static  PB_CMD_MNG     *bot_cm = NULL;
 static  PB_CMD_MNG     *bot_sec_cm = NULL;
+static  PB_CMD_MNG     *admin_cm = NULL;
 
 static  char           *my_key= "KillerBot";
+
+// Reply templates
+static  PB_TMPL        *tm_welcome, *tm_master, *tm_bye, *tm_chat, *tm_help;
 static  PB_SESSION     ses[MAX_CONN];
 static  struct pollfd  pfd[MAX_CONN];
 static  int            running = 1;
+static  __thread PB_RBUF *pb_rb = NULL; // Receive buffer of the loop
+static  __thread PB_DISP pb_disp[PB_DISP_MAX];
+static  __thread int   n_disp = 0;
+static  __thread struct {char *p; int size;} obuf_pool[PB_OBUF_POOL];
+static  __thread int   n_obuf_pool = 0;
+static  int            pipeline = 1;
+static  char           *arena = NULL;     // Current chunk. See pb_arena_alloc
+static  int            arena_used = 0;
+static  PB_RBUF        *rb_free = NULL;   // Receive buffers back to the arena
+static  int            tls_pend = 0;      // Some session has data left in OpenSSL
+
+static  PB_NET         **net = NULL;
+static  int            n_net = 0;
+static  PB_BOT         **bot = NULL;
+static  int            n_bot = 0;
+static  int            ramp = PB_RAMP;
+static  int            pending = 0;
+static  int            backoff_min = PB_BACKOFF_MIN;
+static  int            backoff_max = PB_BACKOFF_MAX;
+static  SSL_CTX        *tls_ctx = NULL;
+static  int            tls_verify = 1;
+static  char           *admin_path = NULL;
+static  uid_t          admin_uid = -1;
+static  long           mem_soft = PB_MEM_SOFT;
+static  long           mem_hard = PB_MEM_HARD;
+
+static  char           *hist_dir = NULL;
+static  long           hist_seg = PB_HIST_SEG;
+static  pthread_t      hist_tid;
+static  pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static  pthread_cond_t hist_cond = PTHREAD_COND_INITIALIZER;
+static  char           *hist_buf = NULL;  // Records from the event loop
+static  int            hist_len = 0, hist_size = 0;
+static  PB_HLOG        **hlog = NULL;     // Changed by the history thread
+static  pthread_mutex_t hidx_lock = PTHREAD_MUTEX_INITIALIZER; // hlog, ti
+static  int            n_hlog = 0;
+static  char           *seen_path = NULL;
+static  int            seen_slots = PB_SEEN_SLOTS;
+static  PB_SEEN_HDR    *seen = NULL;      // Mapping of seen_path
+static  uint16_t       flood[PB_FLOOD_SLOTS][PB_FLOOD_ROWS][PB_FLOOD_COLS];
+static  long long      flood_tick = 0;    // Current sub-window
+static  int            flood_msgs = PB_FLOOD_MSGS;
+static  int            flood_win = PB_FLOOD_WIN;
+static  long           flood_ignored = 0;
+static  char           *dcc_dir = NULL;
+static  char           *dcc_ip = NULL;    // Address to announce
+static  long           dcc_rate = 0;      // Bytes/s per transfer. 0 no cap
+static  long           dcc_total = 0;     // Bytes/s all transfers
+static  double         dcc_tok = 0;       // Bucket for dcc_total
+static  long long      dcc_last = 0;
+static  int            n_dcc = 0;
+static  char           *fact_path = NULL;
+static  PB_FACT_HDR    *fact = NULL;      // Mapping of fact_path
+static  long           fact_len = 0;
+static  int            n_await = 0;       // All sessions
+static  long           whois_ttl = PB_WHOIS_TTL;
+static  int            lowlat = 0;
+static  int            lowlat_spin = 0;   // Microseconds
+static  int            lowlat_cpu[PB_LOWLAT_CPUS];
+static  int            n_lowlat_cpu = 0;
+static  PB_RELAY       *relay = NULL;
+static  int            n_relay = 0;
+static  long           relayed = 0;
+static  int            hugepages = 0;     // Loop arenas on huge pages
+static  char           *pb_caps[] = {"batch", "multi-prefix", "extended-join",
+				     "server-time", "message-tags", NULL};
 
 // Prototypes
-int pb_add_session (char *host, char *nick, char *channel, char *master);
+int pb_add_session (PB_BOT *b);
+void pb_bot_dropped (PB_BOT *b);
+void pb_ses_state_free (PB_SESSION *s);
+PB_NET *pb_net_find (char *name, char *port);
+PB_NET *pb_net_add (char *name, char *host, char *port);
+PB_BOT *pb_bot_add (PB_NET *n, char *nick, char *master, char *channel);
+long long pb_now_ms (void);
+void pb_dcc_free (PB_DCC *d);
+void pb_await_free_all (PB_SESSION *s);
+void pb_whois_free_all (PB_SESSION *s);
+void pb_out_unref (PB_SESSION *s, int n);
+int pb_process_msg (PB_SESSION *s, char *buffer1);
+int pb_hist_map (PB_HIST_MAP *hm, char *key, int seg, char *ext);
+void pb_hist_unmap (PB_HIST_MAP *hm);
+void pb_seen_update (PB_SESSION *s, PB_IRC_MSG *m, char *what, char *chan);
+void pb_whois_invalidate (PB_SESSION *s, char *nick);
 
 /* IRC Message parsing */
+void
+pb_irc_msg_tags (PB_IRC_MSG *m, char *tags) {
+  char      *t, *v, *save;
+  struct tm tm;
+
+  for (t = strtok_r (tags, ";", &save); t; t = strtok_r (NULL, ";", &save)) {
+    if (!(v = strchr (t, '='))) continue;
+    *v++ = 0;
+    if (!strcmp (t, "batch")) m->batch = v;
+    else if (!strcmp (t, "time")) {
+      memset (&tm, 0, sizeof(tm));
+      if (strptime (v, "%Y-%m-%dT%H:%M:%S", &tm)) m->time = timegm (&tm);
+    }
+  }
+}
+
+/* [@tags] [:prefix] command {middle} [:trailing]
+ * Parses p in place. The trailing parameter is not changed */
 int
-pb_irc_msg_parse (PB_IRC_MSG *m, char *buffer) {
-  char *prefix, *aux; 
+pb_irc_msg_split (PB_IRC_MSG *m, char *p) {
+  char *aux; 
   
-  printf ("** Buffer: '%s'\n", buffer);
-  m->b = strdup (buffer);
-  if (m->b[0] == ':') { // Process Prefix 
-    prefix = strtok (m->b, " ");
-    m->cmd = strtok (NULL, " ");
-    m->to = strtok (NULL, "\r");
-    if (m->to && (aux = strchr (m->to, ':'))) {
-      *aux++ = 0;
-      m->pars = strdup (aux);
+  printf ("** Buffer: '%s'\n", p);
+  m->from = "";
+  m->time = time (NULL);
+  if ((aux = strpbrk (p, "\r\n"))) *aux = 0;
+  if (*p == '@') { // IRCv3 message tags
+    if (!(aux = strchr (p, ' '))) return -1;
+    *aux = 0;
+    pb_irc_msg_tags (m, p + 1);
+    for (p = aux + 1; *p == ' '; p++);
+  }
+  if (*p == ':') { // Process Prefix 
+    m->from = ++p;
+    if (!(p = strchr (p, ' '))) return -1;
+    for (*p++ = 0; *p == ' '; p++);
+    if ((aux = strchr (m->from, '!'))) {
+      *aux = 0;
+      m->user = aux + 1;
+    }
+  }
+  if (!*p) return -1;
+  m->cmd = p;
+  while (*p && *p != ' ') p++;
+  while (*p == ' ') *p++ = 0;
+
+  while (*p && m->argc < PB_MAX_ARGS) {
+    if (*p == ':') {
+      m->pars = m->arg[m->argc++] = p + 1;
+      break;
     }
-    m->from = strtok (prefix + 1, "!");
+    m->arg[m->argc++] = p;
+    while (*p && *p != ' ') p++;
+    while (*p == ' ') *p++ = 0;
   }
+  if (m->argc) m->to = m->arg[0];
 
   return 0;
 }
 
+// Parses a copy of buffer. Free it with pb_irc_msg_free
+int
+pb_irc_msg_parse (PB_IRC_MSG *m, char *buffer) {
+  if ((m->b = strdup (buffer)) == NULL) return -1;
+  return pb_irc_msg_split (m, m->b);
+}
+
 int
 pb_irc_msg_free (PB_IRC_MSG *m) {
   if (!m) return -1;
-  if (m->pars) free (m->pars);
   if (m->b) free (m->b);
   return 0;
 }
 
+/* rfc1459 casemapping: []\^ are the upper case of {}|~ */
+static inline int
+pb_irc_tolower (int c) {
+  return (c >= 'A' && c <= '^') ? c + 32 : c;
+}
+
+int
+pb_irc_casecmp (char *a, char *b) {
+  for (; *a && pb_irc_tolower (*a) == pb_irc_tolower (*b); a++, b++);
+  return pb_irc_tolower (*a) - pb_irc_tolower (*b);
+}
+
+unsigned int
+pb_irc_nick_hash (char *nick) {
+  unsigned int h = 2166136261u;
+
+  for (; *nick; nick++) h = (h ^ pb_irc_tolower (*nick)) * 16777619u;
+  return h;
+}
+
 /* Cmd manager helper functions */
 PB_CMD
 pb_cmd_new (char *id, CMD_FUNC f) {
@@ -143,15 +721,36 @@ pb_cmd_mng_add (PB_CMD_MNG *cm, char *id, CMD_FUNC f) {
   return 0;
 }
 
-int
-pb_cmd_mng_run (PB_CMD_MNG *cm, PB_SESSION *s, char *buffer, void *arg) {
+PB_CMD
+pb_cmd_mng_find (PB_CMD_MNG *cm, char *buffer) {
   int i;
   for (i = 0; i < cm->n; i++) {
     if (!strncasecmp (cm->cmd[i]->id, buffer, strlen(cm->cmd[i]->id)))
-      {
-	cm->cmd[i]->f (s, buffer, arg);
-	return 0;
-      }
+      return cm->cmd[i];
+  }
+  return NULL;
+}
+
+static inline int
+pb_cmd_call (PB_CMD c, PB_SESSION *s, char *buffer, void *arg) {
+  int r;
+#ifdef PB_USDT
+  int fd = s ? s->fd : -1; // Before the handler, that may close s
+#endif
+
+  PB_PROBE2 (cmd_entry, c->id, fd);
+  r = c->f (s, buffer, arg);
+  PB_PROBE3 (cmd_return, c->id, fd, r);
+  return r;
+}
+
+int
+pb_cmd_mng_run (PB_CMD_MNG *cm, PB_SESSION *s, char *buffer, void *arg) {
+  PB_CMD c;
+
+  if ((c = pb_cmd_mng_find (cm, buffer))) {
+    pb_cmd_call (c, s, buffer, arg);
+    return 0;
   }
   fprintf (stderr, "E: cmd '%s' unknown\n", buffer);
   return 1; // The higher level do something with the command
@@ -160,28 +759,56 @@ pb_cmd_mng_run (PB_CMD_MNG *cm, PB_SESSION *s, char *buffer, void *arg) {
 /* Poll helper function*/
 int
 pb_add_fd (int fd) {
-  int i;
+  unsigned g;
+  int      i;
 
   for (i = 0; i < MAX_CONN && pfd[i].fd != -1;i++);
   if (i == MAX_CONN) return -1;
 
   pfd[i].fd = fd;
-  pfd[i].events = POLLIN || POLLHUP;
+  pfd[i].events = POLLIN;
 
+  g = ses[i].gen;
+  memset (&ses[i], 0, sizeof(PB_SESSION));
   ses[i].fd = fd;
+  ses[i].gen = g;
 
   return i;
 }
 
 int
 pd_del_index (int i) {
+  PB_BOT *b;
+
+  if (pfd[i].fd == -1) return -1;
   pfd[i].fd = -1;
+  ses[i].gen++;
+  if (ses[i].ssl) SSL_free (ses[i].ssl);
+  ses[i].ssl = NULL;
+  ses[i].ktls = 0;
   close (ses[i].fd);
   ses[i].fd = -1;
 
   if (ses[i].host) free (ses[i].host);
   if (ses[i].nick) free (ses[i].nick);
   if (ses[i].master) free (ses[i].master);
+  ses[i].host = ses[i].nick = ses[i].master = NULL;
+  if (ses[i].rbuf) free (ses[i].rbuf);
+  if (ses[i].obuf) free (ses[i].obuf);
+  ses[i].rbuf = ses[i].obuf = NULL;
+  ses[i].rlen = ses[i].rsize = ses[i].olen = ses[i].osize = 0;
+  if (ses[i].n_oref) pb_out_unref (&ses[i], ses[i].n_oref);
+  pb_ses_state_free (&ses[i]);
+  if (ses[i].dcc) pb_dcc_free (ses[i].dcc);
+  ses[i].dcc = NULL;
+  if (ses[i].alist) free (ses[i].alist);
+  ses[i].alist = NULL;
+
+  // Managed sessions get rescheduled
+  if ((b = ses[i].bot)) {
+    ses[i].bot = NULL;
+    pb_bot_dropped (b);
+  }
 
   return i; 
 }
@@ -207,30 +834,307 @@ pd_find_fd (int fd) {
   return i;
 }
 
+/* Session I/O. Once kTLS is on for a direction the kernel does the
+ * record processing and we use the plain fd, otherwise OpenSSL does it */
+int
+pb_read (PB_SESSION *s, char *buf, int len) {
+  int r, n;
+
+  if (!s->ssl) return read (s->fd, buf, len);
+  if (s->ktls & PB_KTLS_RX) {
+    // Non application data records (tickets, key updates) fail with EIO.
+    // Let OpenSSL consume them
+    if ((r = read (s->fd, buf, len)) >= 0 || errno != EIO) return r;
+  }
+  /* OpenSSL reads whole records, so decrypted data can wait in it with
+   * nothing left in the socket. Take it while it fits. What does not
+   * fit is for the next round, see pb_tls_pending */
+  for (n = 0; n < len; n += r) {
+    if ((r = SSL_read (s->ssl, buf + n, len - n)) <= 0) {
+      if (n) return n; // The error comes again on the next read
+      r = SSL_get_error (s->ssl, r);
+      if (r == SSL_ERROR_ZERO_RETURN) return 0;
+      errno = (r == SSL_ERROR_WANT_WRITE || r == SSL_ERROR_WANT_READ) ? EAGAIN : EIO;
+      return -1;
+    }
+    if (!SSL_pending (s->ssl)) return n + r;
+  }
+  tls_pend = 1;
+  return n;
+}
+
+int
+pb_write (PB_SESSION *s, char *buf, int len) {
+  int r;
+
+  if (!s->ssl || (s->ktls & PB_KTLS_TX)) return write (s->fd, buf, len);
+  if ((r = SSL_write (s->ssl, buf, len)) <= 0) {
+    r = SSL_get_error (s->ssl, r);
+    errno = (r == SSL_ERROR_WANT_WRITE || r == SSL_ERROR_WANT_READ) ? EAGAIN : EIO;
+    return -1;
+  }
+  return r;
+}
+
+/* Output queue. Replies are rendered here and written when the
+ * handlers are done */
+char *
+pb_out_reserve (PB_SESSION *s, int len) {
+  char *aux;
+  int  size, i;
+
+  if (s->olen + len > s->osize) {
+    if (s->ooff) { // Reclaim the space already written
+      memmove (s->obuf, s->obuf + s->ooff, s->olen - s->ooff);
+      s->olen -= s->ooff;
+      for (i = 0; i < s->n_oref; i++) s->oref[i].off -= s->ooff;
+      s->ooff = 0;
+    }
+    if (!s->obuf && n_obuf_pool) {
+      s->obuf = obuf_pool[--n_obuf_pool].p;
+      s->osize = obuf_pool[n_obuf_pool].size;
+    }
+    for (size = s->osize ? s->osize : BSIZE; size < s->olen + len; size *= 2);
+    if (size != s->osize) {
+      if ((aux = realloc (s->obuf, size)) == NULL) return NULL;
+      s->obuf = aux;
+      s->osize = size;
+    }
+  }
+  return s->obuf + s->olen;
+}
+
+int
+pb_out_append (PB_SESSION *s, char *data, int len) {
+  char *o;
+
+  if ((o = pb_out_reserve (s, len)) == NULL) return -1;
+  memcpy (o, data, len);
+  s->olen += len;
+  return len;
+}
+
+/* Queues len bytes at p, that are in rb, without copying them.
+ * rb is kept until they are written */
+int
+pb_out_ref (PB_SESSION *s, char *p, int len, PB_RBUF *rb) {
+  PB_OREF *aux;
+  int     size;
+
+  if (s->n_oref == s->s_oref) {
+    size = s->s_oref ? s->s_oref * 2 : 8;
+    if ((aux = realloc (s->oref, sizeof(PB_OREF) * size)) == NULL) return -1;
+    s->oref = aux;
+    s->s_oref = size;
+  }
+  s->oref[s->n_oref].off = s->olen;
+  s->oref[s->n_oref].p = p;
+  s->oref[s->n_oref].len = len;
+  s->oref[s->n_oref++].rb = rb;
+  rb->ref++;
+  return len;
+}
+
+void
+pb_rbuf_put (PB_RBUF *rb) {
+  if (--rb->ref) return;
+  if (!rb->pool) free (rb);
+  else {
+    rb->next = rb_free;
+    rb_free = rb;
+  }
+}
+
+// Drops the first n references
+void
+pb_out_unref (PB_SESSION *s, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) pb_rbuf_put (s->oref[i].rb);
+  memmove (s->oref, s->oref + n, sizeof(PB_OREF) * (s->n_oref - n));
+  if ((s->n_oref -= n) == 0) {
+    free (s->oref);
+    s->oref = NULL;
+    s->s_oref = 0;
+  }
+}
+
+/* Writes the output queue with its references in one go */
+int
+pb_out_writev (PB_SESSION *s) {
+  struct iovec iov[PB_OUT_IOV];
+  PB_OREF      *o;
+  int          i, n = 0, off = s->ooff, r, w = 0, len;
+
+  for (i = 0; i < s->n_oref && n + 3 <= PB_OUT_IOV; i++) {
+    o = &s->oref[i];
+    if (o->off > off) {
+      iov[n].iov_base = s->obuf + off;
+      iov[n++].iov_len = o->off - off;
+      off = o->off;
+    }
+    iov[n].iov_base = o->p;
+    iov[n++].iov_len = o->len;
+  }
+  if (i == s->n_oref && s->olen > off) {
+    iov[n].iov_base = s->obuf + off;
+    iov[n++].iov_len = s->olen - off;
+  }
+  if (!s->ssl || (s->ktls & PB_KTLS_TX)) {
+    if ((w = writev (s->fd, iov, n)) < 0) return -1;
+  }
+  else
+    for (i = 0; i < n; i++) { // One record per piece
+      if ((r = pb_write (s, iov[i].iov_base, iov[i].iov_len)) < 0) {
+	if (w) break;
+	return -1;
+      }
+      w += r;
+      if (r < iov[i].iov_len) break;
+    }
+
+  // Consume what was written
+  for (r = w; r > 0; ) {
+    if (s->n_oref && s->oref[0].off == s->ooff) {
+      o = &s->oref[0];
+      len = r < o->len ? r : o->len;
+      o->p += len;
+      o->len -= len;
+      if (!o->len) pb_out_unref (s, 1);
+    }
+    else {
+      len = (s->n_oref ? s->oref[0].off : s->olen) - s->ooff;
+      if (len > r) len = r;
+      s->ooff += len;
+    }
+    r -= len;
+  }
+  return w;
+}
+
+int
+pb_out_flush (PB_SESSION *s) {
+  int r;
+
+  if (!s->olen) return 0; // Keep the events of connecting sessions
+
+  while (s->ooff < s->olen || s->n_oref) {
+    if (s->n_oref) r = pb_out_writev (s);
+    else if ((r = pb_write (s, s->obuf + s->ooff, s->olen - s->ooff)) > 0)
+      s->ooff += r;
+    if (r < 0) {
+      if (errno == EAGAIN) break;
+      return -1;
+    }
+  }
+  PB_PROBE3 (flush, s->fd, s->ooff, s->olen - s->ooff);
+  if (s->ooff == s->olen && !s->n_oref) { // Idle sessions hold no output buffer
+    // Buffers go back to the loop. With the pipeline many are in use
+    // at once and freeing them all makes malloc trim and grow the heap
+    if (s->osize <= 2 * BSIZE && n_obuf_pool < PB_OBUF_POOL) {
+      obuf_pool[n_obuf_pool].p = s->obuf;
+      obuf_pool[n_obuf_pool++].size = s->osize;
+    }
+    else
+      free (s->obuf);
+    s->obuf = NULL;
+    s->ooff = s->olen = s->osize = 0;
+  }
+  pfd[s - ses].events = (pfd[s - ses].events & ~POLLOUT) |
+    (s->olen ? POLLOUT : 0);
+  return s->olen - s->ooff;
+}
+
 int
 pb_printf (PB_SESSION *s, char *fmt,...) {
-  char    buf[BSIZE];
+  char    *buf;
   int     len;
   va_list arg;
   
   if (!s) return -1;
   if (!fmt) return -1;
+  if ((buf = pb_out_reserve (s, BSIZE)) == NULL) return -1;
 
   va_start (arg, fmt);
   
-  memset (buf, 0, BSIZE);
-  if ((len = vsnprintf (buf, BSIZE, fmt, arg)) > BSIZE) {
+  if ((len = vsnprintf (buf, BSIZE, fmt, arg)) >= BSIZE) {
     fprintf (stderr, "Output truncated!!!\n");
-    buf[BSIZE - 1] = 0;
+    len = BSIZE - 1;
   }
-  len = write (s->fd, buf, len);
+  s->olen += len;
   va_end (arg);
   
   return len;
 }
 
+/* Reply templates. Most replies are fixed text with one or two %s.
+ * Templates are split once into literal and slot segments, so sending
+ * a reply is copying the pieces into the output queue */
+PB_TMPL *
+pb_tmpl_new (char *fmt) {
+  PB_TMPL *t;
+  char    *p, *q;
+
+  if (!fmt || (t = calloc (1, sizeof(PB_TMPL))) == NULL) return NULL;
+  t->txt = strdup (fmt);
+  for (p = q = t->txt; ; p++) {
+    if (*p && (p[0] != '%' || p[1] != 's')) continue;
+    if (p > q) { // Literal
+      if (t->n == PB_TMPL_SEGS) goto error;
+      t->seg[t->n].p = q;
+      t->seg[t->n++].len = p - q;
+      t->lit += p - q;
+    }
+    if (!*p) break;
+    if (t->n == PB_TMPL_SEGS) goto error;
+    t->seg[t->n++].p = NULL; // Slot
+    q = ++p + 1;
+  }
+  return t;
+
+ error:
+  fprintf (stderr, "E: Template too complex '%s'\n", fmt);
+  free (t->txt);
+  free (t);
+  return NULL;
+}
+
+/* Arguments are the strings for the slots in order */
 int
-pb_server (int port) {
+pb_tmpl_send (PB_SESSION *s, PB_TMPL *t, ...) {
+  char    *arg[PB_TMPL_SEGS], *o;
+  int     alen[PB_TMPL_SEGS], i, len;
+  va_list ap;
+
+  if (!s || !t) return -1;
+  if (t->low && s->shed) {
+    s->dropped++;
+    return 0;
+  }
+  va_start (ap, t);
+  for (len = t->lit, i = 0; i < t->n; i++) {
+    if (t->seg[i].p) continue;
+    if (!(arg[i] = va_arg (ap, char*))) arg[i] = "";
+    len += (alen[i] = strlen (arg[i]));
+  }
+  va_end (ap);
+  if ((o = pb_out_reserve (s, len)) == NULL) return -1;
+
+  for (i = 0; i < t->n; i++) {
+    if (t->seg[i].p) {
+      memcpy (o, t->seg[i].p, t->seg[i].len);
+      o += t->seg[i].len;
+    } else {
+      memcpy (o, arg[i], alen[i]);
+      o += alen[i];
+    }
+  }
+  s->olen += len;
+  return len;
+}
+
+int
+pb_server_addr (in_addr_t addr, int port) {
   struct sockaddr_in server;
   int                s, ops = 1;
 
@@ -242,7 +1146,7 @@ pb_server (int port) {
   server.sin_family = AF_INET;
   server.sin_port = htons (port);
 
-  server.sin_addr.s_addr = INADDR_ANY;
+  server.sin_addr.s_addr = addr;
   if ((setsockopt (s, SOL_SOCKET, SO_REUSEADDR, &ops, sizeof(ops))) < 0)
     perror ("pb_server (reuseaddr):");
   
@@ -262,6 +1166,11 @@ pb_server (int port) {
   return -1;
 }
 
+int
+pb_server (int port) {
+  return pb_server_addr (INADDR_ANY, port);
+}
+
 int 
 pb_connect (char *host, char* port) {
   struct addrinfo hints;
@@ -296,7 +1205,59 @@ pb_connect (char *host, char* port) {
   return sfd;
 }
 
+long long
+pb_now_ms (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+pb_set_blocking (int fd, int blocking) {
+  int flags;
+
+  if ((flags = fcntl (fd, F_GETFL)) < 0) return -1;
+  flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+  return fcntl (fd, F_SETFL, flags);
+}
+
+/* Starts a non-blocking connect to the network. Name resolution is
+ * cached in the network so a ramp of hundreds of bots does not
+ * hit the resolver (which blocks) hundreds of times */
+int
+pb_connect_nb (PB_NET *n) {
+  struct addrinfo hints, *rp;
+  int             sfd, s;
+
+  if (!n) return -1;
+  if (!n->ai) {
+    memset (&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((s = getaddrinfo (n->host, n->port, &hints, &n->ai)) != 0) {
+      fprintf (stderr, "getaddrinfo: %s\n", gai_strerror(s));
+      n->ai = NULL;
+      return -1;
+    }
+    n->ai_cur = n->ai;
+  }
+  rp = n->ai_cur;
+  printf ("Connecting to '%s':%s\n", n->host, n->port);
+
+  if ((sfd = socket (rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+		     rp->ai_protocol)) < 0) {
+    perror ("pb_connect_nb (socket):");
+    return -1;
+  }
+  if (connect (sfd, rp->ai_addr, rp->ai_addrlen) < 0 && errno != EINPROGRESS) {
+    perror ("pb_connect_nb (connect):");
+    close (sfd);
+    return -1;
+  }
 
+  return sfd;
+}
 
 int
 pb_irc_register (PB_SESSION *s, char *nick, char *desc) {
@@ -305,70 +1266,2434 @@ pb_irc_register (PB_SESSION *s, char *nick, char *desc) {
   if (!desc) return -1;
   
   s->nick = strdup (nick);
+  // Registration waits for CAP END when the server supports IRCv3
+  pb_printf (s, "CAP LS 302\n");
   pb_printf (s, "user %s  0 *: %s\n", nick, desc);
   pb_printf (s, "nick %s\n", nick);
   
   return 0;
 }
 
+/* Expands a comma separated list of channels names into IRC targets */
+char *
+pb_irc_chan_list (char *list, int len, char *channel) {
+  char *p = list;
+
+  *p++ = '#';
+  for (; *channel && p < list + len - 3; channel++) {
+    *p++ = *channel;
+    if (*channel == ',') *p++ = '#';
+  }
+  *p = 0;
+  return list;
+}
+
 int
 pb_irc_join (PB_SESSION *s, char *channel) {
+  char list[BSIZE];
+
   if (!s) return -1;
   if (!channel) return -1;
   
-  pb_printf (s, "join #%s\n", channel);
+  pb_irc_chan_list (list, BSIZE, channel);
+  pb_printf (s, "join %s\n", list);
   return 0;
 }
 
 
-/* Actions on IRC messages */
-int
-cmd_irc_join (PB_SESSION *s, char *buffer, void *arg) {
-  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+/* Session state: channel rosters */
+PB_CHAN *
+pb_chan_find (PB_SESSION *s, char *name) {
+  int i;
 
-  if (!strncasecmp (m->cmd, "JOIN", 4) && 
-      strncmp (m->from, s->nick, strlen(s->nick))) {
-    pb_printf (s, "PRIVMSG %s :Welcome %s\n", m->pars, m->from);
-    if (!strncmp (m->from, s->master, strlen(s->master)))
-      pb_printf (s, "PRIVMSG %s :Glad to see you again Master. My key is %s\n", 
-		 s->master, my_key);
-  }
+  for (i = 0; i < s->n_chan; i++)
+    if (!pb_irc_casecmp (s->chan[i]->name, name)) return s->chan[i];
+  return NULL;
+}
 
-  return 0;
+PB_CHAN *
+pb_chan_add (PB_SESSION *s, char *name) {
+  PB_CHAN **aux, *c;
+
+  if ((c = pb_chan_find (s, name))) return c;
+  if ((aux = realloc (s->chan, sizeof(PB_CHAN*) * (s->n_chan + 1))) == NULL)
+    return NULL;
+  s->chan = aux;
+  c = calloc (1, sizeof(PB_CHAN));
+  c->name = strdup (name);
+  s->chan[s->n_chan++] = c;
+
+  return c;
 }
 
-int
-cmd_irc_part (PB_SESSION *s, char *buffer, void *arg) {
-  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+void
+pb_chan_free (PB_CHAN *c) {
+  int i;
 
-  pb_printf (s, "PRIVMSG %s :Bye %s\n", m->to, m->from);
-  return 0;
+  for (i = 0; i < c->n; i++) {
+    free (c->m[i].nick);
+    if (c->m[i].account) free (c->m[i].account);
+  }
+  free (c->m);
+  free (c->name);
+  free (c);
 }
 
-/* Bot Public Commands implementation */
 int
-cmd_bot_chat (PB_SESSION *s, char *buffer, void *arg) {
-  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+pb_chan_del (PB_SESSION *s, char *name) {
+  int i;
 
-  fprintf (stderr, "I: Chat mode '%s'\n", buffer);
-  if (strcasestr (buffer, s->nick))
-    pb_printf (s, "PRIVMSG %s :Hey %s sup\n", m->to, m->from);
+  for (i = 0; i < s->n_chan; i++)
+    if (!pb_irc_casecmp (s->chan[i]->name, name)) {
+      pb_chan_free (s->chan[i]);
+      s->chan[i] = s->chan[--s->n_chan];
+      return 0;
+    }
+  return -1;
+}
 
-  return 0;
+int
+pb_chan_member_find (PB_CHAN *c, char *nick) {
+  int i;
+
+  for (i = 0; i < c->n; i++)
+    if (!pb_irc_casecmp (c->m[i].nick, nick)) return i;
+  return -1;
 }
 
+/* Makes room for n more members */
 int
-cmd_irc_privmsg (PB_SESSION *s, char *buffer, void *arg) {
-  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+pb_chan_grow (PB_CHAN *c, int n) {
+  PB_MEMBER *aux;
+  int       size;
 
-  // Ignore my own messages
-  if (!strncasecmp (m->from, s->nick, strlen(s->nick))) return 0;
+  if (c->n + n <= c->size) return 0;
+  for (size = c->size ? c->size : 8; size < c->n + n; size *= 2);
+  if ((aux = realloc (c->m, sizeof(PB_MEMBER) * size)) == NULL) return -1;
+  c->m = aux;
+  c->mem += sizeof(PB_MEMBER) * (size - c->size);
+  c->size = size;
+  return 0;
+}
 
-  if (m->to[0] == '#') {
-    if (pb_cmd_mng_run (bot_cm, s, m->pars, m))
-      cmd_bot_chat (s, m->pars, m);
+/* Appends without checking for duplicates */
+void
+pb_chan_member_push (PB_CHAN *c, char *nick, char *account, char *mode) {
+  PB_MEMBER *m = &c->m[c->n++];
+
+  m->nick = strdup (nick);
+  m->account = (account && strcmp (account, "*")) ? strdup (account) : NULL;
+  snprintf (m->mode, sizeof(m->mode), "%s", mode ? mode : "");
+  c->mem += strlen (nick) + 1 + (m->account ? strlen (m->account) + 1 : 0);
+}
+
+int
+pb_chan_member_add (PB_CHAN *c, char *nick, char *account, char *mode) {
+  int i;
+
+  if ((i = pb_chan_member_find (c, nick)) >= 0) {
+    if (mode) snprintf (c->m[i].mode, sizeof(c->m[i].mode), "%s", mode);
+    return i;
+  }
+  if (pb_chan_grow (c, 1) < 0) return -1;
+  pb_chan_member_push (c, nick, account, mode);
+  return c->n - 1;
+}
+
+void
+pb_chan_member_del (PB_CHAN *c, int i) {
+  c->mem -= strlen (c->m[i].nick) + 1 +
+    (c->m[i].account ? strlen (c->m[i].account) + 1 : 0);
+  free (c->m[i].nick);
+  if (c->m[i].account) free (c->m[i].account);
+  c->m[i] = c->m[--c->n];
+}
+
+void
+pb_batch_free (PB_BATCH *b) {
+  int i;
+
+  for (i = 0; i < b->n; i++) {
+    free (b->it[i].nick);
+    if (b->it[i].chan) free (b->it[i].chan);
+    if (b->it[i].account) free (b->it[i].account);
+    if (b->it[i].text) free (b->it[i].text);
+  }
+  free (b->it);
+  free (b->ref);
+  free (b);
+}
+
+void
+pb_ses_state_free (PB_SESSION *s) {
+  int i;
+
+  for (i = 0; i < s->n_chan; i++) pb_chan_free (s->chan[i]);
+  for (i = 0; i < s->n_batch; i++) pb_batch_free (s->batch[i]);
+  if (s->chan) free (s->chan);
+  if (s->batch) free (s->batch);
+  s->chan = NULL;
+  s->batch = NULL;
+  s->n_chan = s->n_batch = 0;
+  s->caps = s->caps_ls = 0;
+  pb_await_free_all (s);
+  pb_whois_free_all (s);
+}
+
+/* IRCv3 BATCH. Netsplits and netjoins come as thousands of QUIT/JOIN
+ * lines. Instead of running the handlers for each one we queue them
+ * and update the rosters in a single pass when the batch is closed */
+PB_BATCH *
+pb_batch_find (PB_SESSION *s, char *ref) {
+  int i;
+
+  for (i = 0; i < s->n_batch; i++)
+    if (!strcmp (s->batch[i]->ref, ref)) return s->batch[i];
+  return NULL;
+}
+
+void
+pb_batch_netsplit (PB_SESSION *s, PB_BATCH *b) {
+  unsigned int h, mask, *set;
+  int          i, j, k, size;
+  PB_CHAN      *c;
+  PB_IRC_MSG   q;
+
+  // Each QUIT is seen and drops its WHOIS entry, as if it came alone
+  memset (&q, 0, sizeof(q));
+  for (i = 0; i < b->n; i++) {
+    q.from = b->it[i].nick;
+    q.pars = b->it[i].text;
+    q.time = b->it[i].time;
+    pb_seen_update (s, &q, "quit", NULL);
+    pb_whois_invalidate (s, b->it[i].nick);
+  }
+
+  // Open addressing set of quitting nicks. Slots hold item index + 1
+  for (size = 16; size < b->n * 2; size *= 2);
+  if ((set = calloc (size, sizeof(unsigned int))) == NULL) return;
+  mask = size - 1;
+  for (i = 0; i < b->n; i++) {
+    for (h = pb_irc_nick_hash (b->it[i].nick) & mask; set[h]; h = (h + 1) & mask);
+    set[h] = i + 1;
+  }
+
+  for (i = 0; i < s->n_chan; i++) {
+    c = s->chan[i];
+    for (j = 0; j < c->n; j++) {
+      for (h = pb_irc_nick_hash (c->m[j].nick) & mask; (k = set[h]);
+	   h = (h + 1) & mask)
+	if (!pb_irc_casecmp (b->it[k - 1].nick, c->m[j].nick)) break;
+      if (k) pb_chan_member_del (c, j--);
+    }
+  }
+  free (set);
+}
+
+int
+pb_chan_index (PB_SESSION *s, char *name) {
+  int i;
+
+  for (i = 0; i < s->n_chan; i++)
+    if (!pb_irc_casecmp (s->chan[i]->name, name)) return i;
+  return -1;
+}
+
+void
+pb_batch_netjoin (PB_SESSION *s, PB_BATCH *b) {
+  PB_IRC_MSG q;
+  int        i, k, last = -1, *idx, *cnt;
+
+  // Each JOIN is seen, as if it came alone
+  memset (&q, 0, sizeof(q));
+  for (i = 0; i < b->n; i++) {
+    q.from = b->it[i].nick;
+    q.time = b->it[i].time;
+    pb_seen_update (s, &q, "join", b->it[i].chan);
+  }
+
+  // Resolve channels once and count joins per channel so each
+  // roster grows a single time
+  idx = malloc (sizeof(int) * (b->n + 1));
+  cnt = calloc (s->n_chan + 1, sizeof(int));
+  if (!idx || !cnt) goto cleanup;
+  for (i = 0; i < b->n; i++) {
+    if (last < 0 || pb_irc_casecmp (s->chan[last]->name, b->it[i].chan))
+      last = pb_chan_index (s, b->it[i].chan);
+    if ((idx[i] = last) >= 0) cnt[last]++;
+  }
+  for (k = 0; k < s->n_chan; k++)
+    if (cnt[k] && pb_chan_grow (s->chan[k], cnt[k]) < 0) cnt[k] = 0;
+  for (i = 0; i < b->n; i++)
+    if (idx[i] >= 0 && cnt[idx[i]])
+      pb_chan_member_push (s->chan[idx[i]], b->it[i].nick,
+			   b->it[i].account, NULL);
+ cleanup:
+  if (idx) free (idx);
+  if (cnt) free (cnt);
+}
+
+/* Returns 1 when the message was queued into a batch */
+int
+pb_batch_collect (PB_SESSION *s, PB_IRC_MSG *m) {
+  PB_BATCH      *b;
+  PB_BATCH_ITEM *aux, *it;
+  int           size;
+
+  if (!m->batch || !(b = pb_batch_find (s, m->batch))) return 0;
+  if (b->type == PB_BATCH_NETSPLIT && strcasecmp (m->cmd, "QUIT")) return 0;
+  if (b->type == PB_BATCH_NETJOIN && (strcasecmp (m->cmd, "JOIN") || !m->argc))
+    return 0;
+  if (b->type == PB_BATCH_OTHER) return 0;
+
+  if (b->n == b->size) {
+    size = b->size ? b->size * 2 : 64;
+    if ((aux = realloc (b->it, sizeof(PB_BATCH_ITEM) * size)) == NULL) return 0;
+    b->it = aux;
+    b->mem += sizeof(PB_BATCH_ITEM) * (size - b->size);
+    b->size = size;
+  }
+  it = &b->it[b->n++];
+  it->nick = strdup (m->from);
+  it->chan = NULL;
+  it->account = NULL;
+  it->text = NULL;
+  it->time = m->time;
+  b->mem += strlen (m->from) + 1;
+  if (b->type == PB_BATCH_NETSPLIT && m->pars) {
+    it->text = strdup (m->pars);
+    b->mem += strlen (m->pars) + 1;
+  }
+  if (b->type == PB_BATCH_NETJOIN) {
+    it->chan = strdup (m->arg[0]);
+    b->mem += strlen (m->arg[0]) + 1;
+    if ((s->caps & PB_CAP_EXTENDED_JOIN) && m->argc > 2 && strcmp (m->arg[1], "*")) {
+      it->account = strdup (m->arg[1]);
+      b->mem += strlen (m->arg[1]) + 1;
+    }
+  }
+  return 1;
+}
+
+/* Memory accounting. Bytes held by a session in its buffers and state */
+long
+pb_ses_mem (PB_SESSION *s) {
+  long mem;
+  int  i;
+
+  mem = s->rsize + s->osize + sizeof(PB_OREF) * s->s_oref + sizeof(PB_CHAN*) * s->n_chan +
+    sizeof(PB_BATCH*) * s->n_batch;
+  for (i = 0; i < s->n_chan; i++)
+    mem += sizeof(PB_CHAN) + strlen (s->chan[i]->name) + 1 + s->chan[i]->mem;
+  for (i = 0; i < s->n_oref; i++) mem += s->oref[i].len;
+  for (i = 0; i < s->n_batch; i++)
+    mem += sizeof(PB_BATCH) + strlen (s->batch[i]->ref) + 1 + s->batch[i]->mem;
+  mem += s->n_await * (sizeof(PB_AWAIT) + 64) + s->n_whois * (sizeof(PB_WHOIS) + 128) +
+    s->s_whois * sizeof(PB_WHOIS*);
+  return mem;
+}
+
+/* Applies the shedding policy after a session did some work.
+ * Over the soft budget low priority replies are dropped, and if the
+ * server is not taking our output we stop reading from it. Over the
+ * hard budget the session is closed (and reconnected later) */
+int
+pb_ses_budget (PB_SESSION *s) {
+  long mem = pb_ses_mem (s);
+  int  shed;
+
+  if (mem > mem_hard) {
+    fprintf (stderr, "E: Session '%s@%s' uses %ld bytes. Disconnecting\n",
+	     s->nick, s->host, mem);
+    return -1;
+  }
+  shed = mem <= mem_soft ? PB_SHED_NONE :
+    s->olen > s->ooff ? PB_SHED_PAUSE : PB_SHED_DROP;
+  if (shed != s->shed)
+    fprintf (stderr, "I: Session '%s@%s' uses %ld bytes. Shedding level %d\n",
+	     s->nick, s->host, mem, shed);
+  s->shed = shed;
+  if (shed == PB_SHED_PAUSE) pfd[s - ses].events &= ~POLLIN;
+  else pfd[s - ses].events |= POLLIN;
+
+  return 0;
+}
+
+/* IRCv3 capability negotiation */
+int
+cmd_irc_cap (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  char       req[BSIZE], *t, *aux, *save;
+  int        i, len, on;
+
+  if (m->argc < 3) return 0;
+  if (!strcasecmp (m->arg[1], "LS")) {
+    for (t = strtok_r (m->arg[m->argc - 1], " ", &save); t;
+	 t = strtok_r (NULL, " ", &save)) {
+      if ((aux = strchr (t, '='))) *aux = 0; // CAP 302 values
+      for (i = 0; pb_caps[i]; i++)
+	if (!strcasecmp (t, pb_caps[i])) s->caps_ls |= 1 << i;
+    }
+    if (m->argc > 3 && !strcmp (m->arg[2], "*")) return 0; // More to come
+    for (len = 0, i = 0; pb_caps[i]; i++)
+      if (s->caps_ls & (1 << i))
+	len += snprintf (req + len, BSIZE - len, "%s%s", len ? " " : "", pb_caps[i]);
+    if (len) pb_printf (s, "CAP REQ :%s\n", req);
+    else pb_printf (s, "CAP END\n");
+  }
+  else if (!strcasecmp (m->arg[1], "ACK")) {
+    for (t = strtok_r (m->arg[m->argc - 1], " ", &save); t;
+	 t = strtok_r (NULL, " ", &save)) {
+      if (!(on = (*t != '-'))) t++;
+      for (i = 0; pb_caps[i]; i++)
+	if (!strcasecmp (t, pb_caps[i]))
+	  s->caps = on ? s->caps | (1 << i) : s->caps & ~(1 << i);
+    }
+    fprintf (stderr, "I: '%s' capabilities 0x%02x\n", s->host, s->caps);
+    pb_printf (s, "CAP END\n");
+  }
+  else if (!strcasecmp (m->arg[1], "NAK"))
+    pb_printf (s, "CAP END\n");
+
+  return 0;
+}
+
+int
+cmd_irc_batch (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  PB_BATCH   **aux, *b;
+  int        i;
+
+  if (m->argc < 1 || strlen (m->arg[0]) < 2) return 0;
+  if (m->arg[0][0] == '+') {
+    aux = realloc (s->batch, sizeof(PB_BATCH*) * (s->n_batch + 1));
+    if (aux == NULL) return -1;
+    s->batch = aux;
+    b = calloc (1, sizeof(PB_BATCH));
+    b->ref = strdup (m->arg[0] + 1);
+    if (m->argc > 1 && !strcasecmp (m->arg[1], "netsplit"))
+      b->type = PB_BATCH_NETSPLIT;
+    else if (m->argc > 1 && !strcasecmp (m->arg[1], "netjoin"))
+      b->type = PB_BATCH_NETJOIN;
+    s->batch[s->n_batch++] = b;
+    return 0;
+  }
+  for (i = 0; i < s->n_batch; i++)
+    if (!strcmp (s->batch[i]->ref, m->arg[0] + 1)) {
+      b = s->batch[i];
+      s->batch[i] = s->batch[--s->n_batch];
+      if (b->type == PB_BATCH_NETSPLIT) pb_batch_netsplit (s, b);
+      else if (b->type == PB_BATCH_NETJOIN) pb_batch_netjoin (s, b);
+      if (b->n) fprintf (stderr, "I: Batch '%s' applied %d updates\n",
+			 b->ref, b->n);
+      pb_batch_free (b);
+      break;
+    }
+  return 0;
+}
+
+/* Channel history. Channel messages are queued by the event loop and
+ * written in batches by a separate thread to an append-only log per
+ * channel: <dir>/<network>/<channel>/<segment>.log with one record per
+ * line ("time nick text"). Each segment has a .idx file with a
+ * time/offset entry every PB_HIST_EVERY records. Queries mmap the
+ * segments and stream lines from the mapping */
+void
+pb_hist_key (char *key, int len, PB_SESSION *s, char *chan) {
+  char *p;
+
+  snprintf (key, len, "%s/", s->bot ? s->bot->net->name : s->host);
+  for (p = key + strlen (key); *chan && p < key + len - 1; chan++)
+    *p++ = *chan == '/' ? '_' : pb_irc_tolower (*chan);
+  *p = 0;
+}
+
+int
+pb_hist_add (PB_SESSION *s, PB_IRC_MSG *m) {
+  char key[512], *aux;
+  int  len, size;
+
+  if (!hist_dir) return 0;
+  pb_hist_key (key, sizeof(key), s, m->to);
+  len = strlen (key) + 1 + 24 + strlen (m->from) + strlen (m->pars) + 3;
+
+  pthread_mutex_lock (&hist_lock);
+  if (hist_len + len > hist_size) {
+    for (size = hist_size ? hist_size : 65536; size < hist_len + len; size *= 2);
+    if ((aux = realloc (hist_buf, size)) == NULL) {
+      pthread_mutex_unlock (&hist_lock);
+      return -1;
+    }
+    hist_buf = aux;
+    hist_size = size;
+  }
+  hist_len += sprintf (hist_buf + hist_len, "%s", key) + 1;
+  hist_len += sprintf (hist_buf + hist_len, "%lld %s %s\n",
+		       (long long) m->time, m->from, m->pars);
+  pthread_mutex_unlock (&hist_lock);
+
+  return 0;
+}
+
+int
+pb_mkdir_p (char *path) {
+  char dir[1024], *p;
+
+  snprintf (dir, sizeof(dir), "%s", path);
+  for (p = dir + 1; *p; p++)
+    if (*p == '/') {
+      *p = 0;
+      if (mkdir (dir, 0755) < 0 && errno != EEXIST) return -1;
+      *p = '/';
+    }
+  return (mkdir (dir, 0755) < 0 && errno != EEXIST) ? -1 : 0;
+}
+
+/* Finds the first and last segment of a channel log */
+int
+pb_hist_segs (char *key, int *first, int *last) {
+  char          path[1024];
+  DIR           *d;
+  struct dirent *e;
+  int           n;
+
+  snprintf (path, sizeof(path), "%s/%s", hist_dir, key);
+  if ((d = opendir (path)) == NULL) return -1;
+  *first = *last = -1;
+  while ((e = readdir (d)))
+    if (sscanf (e->d_name, "%d.log", &n) == 1 && strstr (e->d_name, ".log")) {
+      if (*first < 0 || n < *first) *first = n;
+      if (n > *last) *last = n;
+    }
+  closedir (d);
+  return *last < 0 ? -1 : 0;
+}
+
+/* Term index. The history thread adds the words of each record to
+ * the index of its channel as it writes the log. When a segment is
+ * full its index goes to a term file (.trm) and term files are merged
+ * in the background so there are a few per channel. Queries use the
+ * term files plus the index in memory */
+int
+pb_varint_put (uint8_t *p, uint64_t v) {
+  int n = 0;
+
+  for (; v >= 0x80; v >>= 7) p[n++] = (v & 0x7f) | 0x80;
+  p[n++] = v;
+  return n;
+}
+
+uint8_t *
+pb_varint_get (uint8_t *p, uint8_t *end, uint64_t *v) {
+  int shift = 0;
+
+  for (*v = 0; p < end; shift += 7) {
+    *v |= (uint64_t) (*p & 0x7f) << shift;
+    if (!(*p++ & 0x80)) return p;
+  }
+  return NULL;
+}
+
+#define PB_TERM_CHAR(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+			 ((c) >= '0' && (c) <= '9') || (c) >= 0x80)
+
+/* Next word in [*pp, end). Case folded and truncated to PB_TERM_MAX - 1 */
+int
+pb_term_next (char **pp, char *end, char *term) {
+  unsigned char *p = (unsigned char*) *pp;
+  int           n = 0;
+
+  for (; p < (unsigned char*) end && !PB_TERM_CHAR (*p); p++);
+  for (; p < (unsigned char*) end && PB_TERM_CHAR (*p); p++)
+    if (n < PB_TERM_MAX - 1) term[n++] = (*p >= 'A' && *p <= 'Z') ? *p + 32 : *p;
+  term[n] = 0;
+  *pp = (char*) p;
+  return n;
+}
+
+unsigned int
+pb_term_hash (char *term) {
+  unsigned int h = 2166136261u;
+
+  for (; *term; term++) h = (h ^ (unsigned char) *term) * 16777619u;
+  return h;
+}
+
+PB_POST *
+pb_tidx_find (PB_TIDX *ti, char *term, int add) {
+  PB_POST *t;
+  int     i, j, mask;
+
+  if (!ti->size) {
+    if (!add) return NULL;
+    ti->t = calloc (ti->size = 256, sizeof(PB_POST));
+  }
+  mask = ti->size - 1;
+  for (i = pb_term_hash (term) & mask; ti->t[i].term; i = (i + 1) & mask)
+    if (!strcmp (ti->t[i].term, term)) return &ti->t[i];
+  if (!add) return NULL;
+  if (ti->n * 2 >= ti->size) {
+    // Grow and look for the free slot again
+    if ((t = calloc (ti->size * 2, sizeof(PB_POST))) == NULL) return NULL;
+    for (j = 0, mask = ti->size * 2 - 1; j < ti->size; j++)
+      if (ti->t[j].term) {
+	for (i = pb_term_hash (ti->t[j].term) & mask; t[i].term; i = (i + 1) & mask);
+	t[i] = ti->t[j];
+      }
+    free (ti->t);
+    ti->t = t;
+    ti->size *= 2;
+    for (i = pb_term_hash (term) & mask; ti->t[i].term; i = (i + 1) & mask);
+  }
+  ti->t[i].term = strdup (term);
+  ti->n++;
+  return &ti->t[i];
+}
+
+void
+pb_tidx_post (PB_TIDX *ti, char *term, uint64_t id) {
+  PB_POST *p;
+  uint8_t *aux;
+
+  if (!(p = pb_tidx_find (ti, term, 1))) return;
+  if (p->cnt && p->last == id) return; // Word repeated in the record
+  if (p->len + 10 > p->size) {
+    if ((aux = realloc (p->p, p->size ? p->size * 2 : 16)) == NULL) return;
+    p->p = aux;
+    p->size = p->size ? p->size * 2 : 16;
+  }
+  p->len += pb_varint_put (p->p + p->len, id - p->last);
+  p->last = id;
+  p->cnt++;
+}
+
+/* Indexes the text of a log record "time nick text\n" */
+void
+pb_tidx_add_line (PB_TIDX *ti, uint64_t id, char *line, char *end) {
+  char term[PB_TERM_MAX];
+  int  i, n;
+
+  for (i = 0; i < 2 && line < end; line++) if (*line == ' ') i++;
+  while ((n = pb_term_next (&line, end, term)) > 0)
+    if (n > 1) pb_tidx_post (ti, term, id);
+}
+
+void
+pb_tidx_free (PB_TIDX *ti) {
+  int i;
+
+  for (i = 0; i < ti->size; i++)
+    if (ti->t[i].term) {
+      free (ti->t[i].term);
+      free (ti->t[i].p);
+    }
+  free (ti->t);
+  memset (ti, 0, sizeof(PB_TIDX));
+}
+
+int
+pb_tidx_cmp (const void *a, const void *b) {
+  return strcmp ((*(PB_POST**) a)->term, (*(PB_POST**) b)->term);
+}
+
+/* Writes a term file. It replaces any file with the same first segment */
+int
+pb_tfile_write (char *key, PB_TFILE_HDR *hdr, PB_TFILE_ENT *e, uint8_t **post) {
+  char     path[PATH_MAX], tmp[PATH_MAX + 5];
+  FILE     *f;
+  uint32_t i;
+  int      r;
+
+  if (snprintf (path, sizeof(path), "%s/%s/%08u.trm", hist_dir, key,
+		hdr->first) >= sizeof(path)) return -1;
+  snprintf (tmp, sizeof(tmp), "%s.new", path);
+  if ((f = fopen (tmp, "w")) == NULL) return -1;
+  fwrite (hdr, sizeof(PB_TFILE_HDR), 1, f);
+  fwrite (e, sizeof(PB_TFILE_ENT), hdr->n, f);
+  for (i = 0; i < hdr->n; i++) fwrite (post[i], 1, e[i].len, f);
+  r = ferror (f);
+  if (fclose (f) || r || rename (tmp, path) < 0) {
+    perror ("pb_tfile_write:");
+    unlink (tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Term file of a segment from its index in memory */
+int
+pb_tidx_write (PB_TIDX *ti, char *key, int seg) {
+  PB_TFILE_HDR hdr = {PB_TIDX_MAGIC, seg, seg, 0};
+  PB_TFILE_ENT *e;
+  PB_POST      **s;
+  uint8_t      **post;
+  uint32_t     off;
+  int          i, r = -1;
+
+  s = malloc (sizeof(PB_POST*) * (ti->n + 1));
+  e = calloc (ti->n + 1, sizeof(PB_TFILE_ENT));
+  post = malloc (sizeof(uint8_t*) * (ti->n + 1));
+  if (!s || !e || !post) goto out;
+  for (i = 0; i < ti->size; i++)
+    if (ti->t[i].term) s[hdr.n++] = &ti->t[i];
+  qsort (s, hdr.n, sizeof(PB_POST*), pb_tidx_cmp);
+  off = sizeof(PB_TFILE_HDR) + hdr.n * sizeof(PB_TFILE_ENT);
+  for (i = 0; i < hdr.n; i++) {
+    strncpy (e[i].term, s[i]->term, PB_TERM_MAX - 1);
+    e[i].off = off;
+    off += e[i].len = s[i]->len;
+    e[i].cnt = s[i]->cnt;
+    e[i].last = s[i]->last;
+    post[i] = s[i]->p;
+  }
+  r = pb_tfile_write (key, &hdr, e, post);
+ out:
+  free (s);
+  free (e);
+  free (post);
+  return r;
+}
+
+/* Term files of a channel sorted by first segment */
+int
+pb_tfile_list (char *key, int *seg, int max) {
+  char          path[1024];
+  DIR           *d;
+  struct dirent *e;
+  int           n = 0, i, s;
+
+  snprintf (path, sizeof(path), "%s/%s", hist_dir, key);
+  if ((d = opendir (path)) == NULL) return 0;
+  while ((e = readdir (d)) && n < max)
+    if (sscanf (e->d_name, "%d.trm", &s) == 1 &&
+	!strcmp (strchr (e->d_name, '.'), ".trm")) {
+      for (i = n++; i > 0 && seg[i - 1] > s; i--) seg[i] = seg[i - 1];
+      seg[i] = s;
+    }
+  closedir (d);
+  return n;
+}
+
+PB_TFILE_HDR *
+pb_tfile_map (PB_HIST_MAP *hm, char *key, int seg) {
+  PB_TFILE_HDR *h;
+
+  if (pb_hist_map (hm, key, seg, "trm") < 0) return NULL;
+  h = (PB_TFILE_HDR*) hm->p;
+  if (hm->len < sizeof(PB_TFILE_HDR) || h->magic != PB_TIDX_MAGIC ||
+      hm->len < sizeof(PB_TFILE_HDR) + (long) h->n * sizeof(PB_TFILE_ENT)) {
+    pb_hist_unmap (hm);
+    return NULL;
+  }
+  return h;
+}
+
+/* Merges the term files of two consecutive segment ranges. Postings
+ * are copied as they are. Only the first delta of b changes */
+int
+pb_tfile_merge (char *key, PB_HIST_MAP *ma, PB_HIST_MAP *mb) {
+  PB_TFILE_HDR *a = (PB_TFILE_HDR*) ma->p, *b = (PB_TFILE_HDR*) mb->p, hdr;
+  PB_TFILE_ENT *ea = (PB_TFILE_ENT*) (a + 1), *eb = (PB_TFILE_ENT*) (b + 1), *e;
+  uint8_t      **post, *pb, *q;
+  char         *own;  // Postings allocated here
+  uint32_t     i = 0, j = 0, off;
+  uint64_t     v;
+  int          c, n, r = -1;
+
+  hdr.magic = PB_TIDX_MAGIC;
+  hdr.first = a->first;
+  hdr.last = b->last;
+  hdr.n = 0;
+  e = calloc (a->n + b->n + 1, sizeof(PB_TFILE_ENT));
+  post = calloc (a->n + b->n + 1, sizeof(uint8_t*));
+  own = calloc (a->n + b->n + 1, 1);
+  if (!e || !post || !own) goto out;
+  while (i < a->n || j < b->n) {
+    c = i == a->n ? 1 : j == b->n ? -1 : strncmp (ea[i].term, eb[j].term, PB_TERM_MAX);
+    if (c < 0) {
+      e[hdr.n] = ea[i];
+      post[hdr.n++] = (uint8_t*) ma->p + ea[i++].off;
+    }
+    else if (c > 0) {
+      e[hdr.n] = eb[j];
+      post[hdr.n++] = (uint8_t*) mb->p + eb[j++].off;
+    }
+    else {
+      pb = (uint8_t*) mb->p + eb[j].off;
+      if (!(q = pb_varint_get (pb, pb + eb[j].len, &v)) ||
+	  !(post[hdr.n] = malloc (ea[i].len + eb[j].len + 10))) goto out;
+      memcpy (post[hdr.n], ma->p + ea[i].off, ea[i].len);
+      n = ea[i].len + pb_varint_put (post[hdr.n] + ea[i].len, v - ea[i].last);
+      memcpy (post[hdr.n] + n, q, eb[j].len - (q - pb));
+      e[hdr.n] = ea[i];
+      e[hdr.n].len = n + eb[j].len - (q - pb);
+      e[hdr.n].cnt += eb[j].cnt;
+      e[hdr.n].last = eb[j].last;
+      own[hdr.n++] = 1;
+      i++, j++;
+    }
+  }
+  for (i = 0, off = sizeof(PB_TFILE_HDR) + hdr.n * sizeof(PB_TFILE_ENT);
+       i < hdr.n; off += e[i++].len)
+    e[i].off = off;
+  r = pb_tfile_write (key, &hdr, e, post);
+ out:
+  if (own)
+    for (i = 0; i < hdr.n; i++) if (own[i]) free (post[i]);
+  free (e);
+  free (post);
+  free (own);
+  return r;
+}
+
+/* Merges the two newest term files while the older one does not
+ * cover more segments than the newer. Like a binary counter, a
+ * channel with n segments ends up with about log2(n) files */
+void
+pb_tfile_compact (char *key) {
+  PB_HIST_MAP  ma, mb;
+  PB_TFILE_HDR *a, *b;
+  char         path[1024];
+  int          seg[PB_TFILE_MAX], n, r;
+
+  while ((n = pb_tfile_list (key, seg, PB_TFILE_MAX)) > 1) {
+    if (!(a = pb_tfile_map (&ma, key, seg[n - 2]))) break;
+    if (!(b = pb_tfile_map (&mb, key, seg[n - 1]))) {
+      pb_hist_unmap (&ma);
+      break;
+    }
+    r = a->last - a->first > b->last - b->first ? -1 : pb_tfile_merge (key, &ma, &mb);
+    pb_hist_unmap (&ma);
+    pb_hist_unmap (&mb);
+    if (r < 0) break;
+    snprintf (path, sizeof(path), "%s/%s/%08d.trm", hist_dir, key, seg[n - 1]);
+    unlink (path);
+  }
+}
+
+/* Indexes a log segment into ti */
+void
+pb_tidx_load (PB_TIDX *ti, char *key, int seg) {
+  PB_HIST_MAP map;
+  char        *p, *e;
+
+  if (pb_hist_map (&map, key, seg, "log") < 0) return;
+  for (p = map.p; (e = memchr (p, '\n', map.p + map.len - p)); p = e + 1)
+    pb_tidx_add_line (ti, (uint64_t) seg << 32 | (p - map.p), p, e);
+  pb_hist_unmap (&map);
+}
+
+/* Segment full. Its index goes to disk */
+void
+pb_tidx_seal (PB_HLOG *h) {
+  pb_tidx_write (&h->ti, h->key, h->seg);
+  pthread_mutex_lock (&hidx_lock);
+  pb_tidx_free (&h->ti);
+  pthread_mutex_unlock (&hidx_lock);
+  pb_tfile_compact (h->key);
+}
+
+/* Rebuilds the indexes missing after a restart. Segments not in a
+ * term file get one. The last one is loaded in memory */
+void
+pb_tidx_recover (PB_HLOG *h, int first) {
+  PB_HIST_MAP  map;
+  PB_TFILE_HDR *t;
+  PB_TIDX      ti;
+  int          seg[PB_TFILE_MAX], n, i, s, next = first;
+
+  n = pb_tfile_list (h->key, seg, PB_TFILE_MAX);
+  for (i = 0; i <= n; i++) {
+    s = i < n ? seg[i] : h->seg;
+    for (; next < s && next < h->seg; next++) {
+      memset (&ti, 0, sizeof(ti));
+      pb_tidx_load (&ti, h->key, next);
+      if (ti.n) pb_tidx_write (&ti, h->key, next);
+      pb_tidx_free (&ti);
+    }
+    if (i < n && (t = pb_tfile_map (&map, h->key, seg[i]))) {
+      if (t->last >= next) next = t->last + 1;
+      pb_hist_unmap (&map);
+    }
+  }
+  pb_tfile_compact (h->key);
+  pb_tidx_load (&h->ti, h->key, h->seg);
+}
+
+int
+pb_hlog_open (PB_HLOG *h) {
+  char        path[1024];
+  struct stat st;
+
+  snprintf (path, sizeof(path), "%s/%s/%08d.log", hist_dir, h->key, h->seg);
+  if ((h->fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+    return -1;
+  fstat (h->fd, &st);
+  h->size = st.st_size;
+  h->cnt = 0; // Next record gets an index entry
+  snprintf (path, sizeof(path), "%s/%s/%08d.idx", hist_dir, h->key, h->seg);
+  if ((h->ifd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+    close (h->fd);
+    return -1;
+  }
+  return 0;
+}
+
+PB_HLOG *
+pb_hlog_get (char *key) {
+  PB_HLOG **aux, *h;
+  char    path[1024];
+  int     i, first;
+
+  for (i = 0; i < n_hlog; i++)
+    if (!strcmp (hlog[i]->key, key)) return hlog[i];
+
+  snprintf (path, sizeof(path), "%s/%s", hist_dir, key);
+  if (pb_mkdir_p (path) < 0) return NULL;
+  h = calloc (1, sizeof(PB_HLOG));
+  h->key = strdup (key);
+  if (pb_hist_segs (key, &first, &h->seg) < 0) first = h->seg = 0;
+  if (pb_hlog_open (h) < 0) {
+    perror ("pb_hlog_get:");
+    free (h->key);
+    free (h);
+    return NULL;
+  }
+  pb_tidx_recover (h, first);
+  pthread_mutex_lock (&hidx_lock);
+  if ((aux = realloc (hlog, sizeof(PB_HLOG*) * (n_hlog + 1))) != NULL) {
+    hlog = aux;
+    hlog[n_hlog++] = h;
+  }
+  pthread_mutex_unlock (&hidx_lock);
+  return h;
+}
+
+void
+pb_hlog_flush (PB_HLOG *h) {
+  if (h->wlen && write (h->fd, h->wbuf, h->wlen) != h->wlen)
+    perror ("pb_hlog_flush (log):");
+  if (h->ilen && write (h->ifd, h->ibuf, h->ilen * sizeof(PB_HIST_IDX)) !=
+      h->ilen * sizeof(PB_HIST_IDX))
+    perror ("pb_hlog_flush (idx):");
+  h->size += h->wlen;
+  h->wlen = h->ilen = 0;
+}
+
+void
+pb_hlog_append (PB_HLOG *h, char *line, int len) {
+  char        *aux;
+  PB_HIST_IDX *iaux;
+  int         size;
+
+  if (h->size + h->wlen + len > hist_seg && h->size + h->wlen > 0) {
+    pb_hlog_flush (h);
+    pb_tidx_seal (h);
+    close (h->fd);
+    close (h->ifd);
+    h->seg++;
+    if (pb_hlog_open (h) < 0) return;
+  }
+  if (h->wlen + len > h->wsize) {
+    for (size = h->wsize ? h->wsize : BSIZE; size < h->wlen + len; size *= 2);
+    if ((aux = realloc (h->wbuf, size)) == NULL) return;
+    h->wbuf = aux;
+    h->wsize = size;
+  }
+  if (h->cnt++ % PB_HIST_EVERY == 0) {
+    if (h->ilen == h->isize) {
+      size = h->isize ? h->isize * 2 : 16;
+      if ((iaux = realloc (h->ibuf, sizeof(PB_HIST_IDX) * size)) == NULL) return;
+      h->ibuf = iaux;
+      h->isize = size;
+    }
+    h->ibuf[h->ilen].time = strtoul (line, NULL, 10);
+    h->ibuf[h->ilen++].off = h->size + h->wlen;
+  }
+  pthread_mutex_lock (&hidx_lock);
+  pb_tidx_add_line (&h->ti, (uint64_t) h->seg << 32 | (h->size + h->wlen),
+		    line, line + len - 1);
+  pthread_mutex_unlock (&hidx_lock);
+  memcpy (h->wbuf + h->wlen, line, len);
+  h->wlen += len;
+}
+
+/* Opens the channel logs on disk so their indexes are ready for queries */
+void
+pb_hist_open_all (void) {
+  char          path[1024], key[512];
+  DIR           *d, *d1;
+  struct dirent *e, *e1;
+
+  if ((d = opendir (hist_dir)) == NULL) return;
+  while ((e = readdir (d))) {
+    if (e->d_name[0] == '.') continue;
+    snprintf (path, sizeof(path), "%s/%s", hist_dir, e->d_name);
+    if ((d1 = opendir (path)) == NULL) continue;
+    while ((e1 = readdir (d1)))
+      if (e1->d_name[0] != '.') {
+	snprintf (key, sizeof(key), "%s/%s", e->d_name, e1->d_name);
+	pb_hlog_get (key);
+      }
+    closedir (d1);
+  }
+  closedir (d);
+}
+
+void *
+pb_hist_writer (void *arg) {
+  struct timespec ts;
+  char            *buf = NULL, *p, *line, *e;
+  int             len, size = 0, i;
+  PB_HLOG         *h;
+
+  pb_hist_open_all ();
+  while (1) {
+    // Let records pile up for a while. One write per channel per round
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_nsec += PB_HIST_FLUSH * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_mutex_lock (&hist_lock);
+    pthread_cond_timedwait (&hist_cond, &hist_lock, &ts);
+    // Swap buffers. The event loop keeps queuing in the other one
+    p = hist_buf; hist_buf = buf; buf = p;
+    i = hist_size; hist_size = size; size = i;
+    len = hist_len;
+    hist_len = 0;
+    pthread_mutex_unlock (&hist_lock);
+
+    for (p = buf, h = NULL; p < buf + len; p = e + 1) {
+      line = p + strlen (p) + 1;
+      e = strchr (line, '\n');
+      if (!h || strcmp (h->key, p)) h = pb_hlog_get (p);
+      if (h) pb_hlog_append (h, line, e - line + 1);
+    }
+    for (i = 0; i < n_hlog; i++) pb_hlog_flush (hlog[i]);
+  }
+  return NULL;
+}
+
+int
+pb_hist_init (void) {
+  if (!hist_dir) return 0;
+  if (pb_mkdir_p (hist_dir) < 0) {
+    perror ("pb_hist_init:");
+    return -1;
+  }
+  return pthread_create (&hist_tid, NULL, pb_hist_writer, NULL);
+}
+
+/* Read side. Segments are mapped read only. The writer may be
+ * appending, so a last line without '\n' is ignored */
+int
+pb_hist_map (PB_HIST_MAP *hm, char *key, int seg, char *ext) {
+  char        path[1024];
+  struct stat st;
+  int         fd;
+
+  hm->p = NULL;
+  hm->len = 0;
+  snprintf (path, sizeof(path), "%s/%s/%08d.%s", hist_dir, key, seg, ext);
+  if ((fd = open (path, O_RDONLY)) < 0) return -1;
+  if (fstat (fd, &st) < 0 || st.st_size == 0) {
+    close (fd);
+    return -1;
+  }
+  hm->p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (hm->p == MAP_FAILED) {
+    hm->p = NULL;
+    return -1;
+  }
+  hm->len = st.st_size;
+  return 0;
+}
+
+void
+pb_hist_unmap (PB_HIST_MAP *hm) {
+  if (hm->p) munmap (hm->p, hm->len);
+  hm->p = NULL;
+}
+
+/* Sends a log line to nick as "[dd/mm HH:MM] <nick> text" */
+void
+pb_hist_send (PB_SESSION *s, char *to, char *line, char *end) {
+  char      *nick, *text, tbuf[16];
+  time_t    t = strtoll (line, &nick, 10);
+  struct tm tm;
+
+  if (nick >= end) return;
+  nick++;
+  if (!(text = memchr (nick, ' ', end - nick))) return;
+  strftime (tbuf, sizeof(tbuf), "%d/%m %H:%M", gmtime_r (&t, &tm));
+  pb_printf (s, "PRIVMSG %s :[%s] <%.*s> %.*s\n", to, tbuf,
+	     (int) (text - nick), nick, (int) (end - text - 1), text + 1);
+}
+
+/* Last n lines of a channel. Walks the segments backwards */
+int
+pb_hist_last (PB_SESSION *s, char *to, char *key, int n) {
+  PB_HIST_MAP map[8];
+  char        *ln[PB_HIST_MAX], *le[PB_HIST_MAX], *p, *e;
+  int         first, seg, nmap = 0, cnt = 0, i;
+
+  if (pb_hist_segs (key, &first, &seg) < 0) return 0;
+  if (n > PB_HIST_MAX) n = PB_HIST_MAX;
+  for (; seg >= first && cnt < n && nmap < 8; seg--) {
+    if (pb_hist_map (&map[nmap], key, seg, "log") < 0) continue;
+    p = map[nmap].p;
+    e = p + map[nmap].len;
+    while (e > p && e[-1] != '\n') e--; // Partial write in progress
+    while (e > p && cnt < n) {
+      le[cnt] = e - 1;
+      for (e--; e > p && e[-1] != '\n'; e--);
+      ln[cnt++] = e;
+    }
+    nmap++;
+  }
+  for (i = cnt - 1; i >= 0; i--) pb_hist_send (s, to, ln[i], le[i]);
+  for (i = 0; i < nmap; i++) pb_hist_unmap (&map[i]);
+  return cnt;
+}
+
+/* Lines since a given time. The index of each segment tells where
+ * to start without scanning the log */
+int
+pb_hist_since (PB_SESSION *s, char *to, char *key, time_t since) {
+  PB_HIST_MAP map, idx;
+  PB_HIST_IDX *ix;
+  char        *p, *e, *end;
+  int         first, last, seg, lo, hi, mid, n, cnt = 0;
+
+  if (pb_hist_segs (key, &first, &last) < 0) return 0;
+  // Newest segment starting before 'since'
+  for (seg = last; seg > first; seg--) {
+    if (pb_hist_map (&idx, key, seg, "idx") < 0) continue;
+    n = ((PB_HIST_IDX*) idx.p)->time <= since;
+    pb_hist_unmap (&idx);
+    if (n) break;
+  }
+  for (; seg <= last && cnt < PB_HIST_MAX; seg++) {
+    if (pb_hist_map (&map, key, seg, "log") < 0) continue;
+    p = map.p;
+    end = map.p + map.len;
+    // Last index entry before 'since'
+    if (pb_hist_map (&idx, key, seg, "idx") == 0) {
+      ix = (PB_HIST_IDX*) idx.p;
+      for (lo = 0, hi = idx.len / sizeof(PB_HIST_IDX); hi - lo > 1; ) {
+	mid = (lo + hi) / 2;
+	if (ix[mid].time < since) lo = mid;
+	else hi = mid;
+      }
+      if (ix[lo].time < since && ix[lo].off < map.len) p = map.p + ix[lo].off;
+      pb_hist_unmap (&idx);
+    }
+    for (; p < end && cnt < PB_HIST_MAX && (e = memchr (p, '\n', end - p));
+	 p = e + 1)
+      if (strtoll (p, NULL, 10) >= since) {
+	pb_hist_send (s, to, p, e);
+	cnt++;
+      }
+    pb_hist_unmap (&map);
+  }
+  return cnt;
+}
+
+/* @last [n | minutes m | hours h] */
+int
+cmd_bot_last (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  char       key[512], unit = 0;
+  int        n = 10;
+
+  if (!hist_dir) return 0;
+  sscanf (buffer + strlen ("@last"), "%d%c", &n, &unit);
+  pb_hist_key (key, sizeof(key), s, m->to);
+  if (unit == 'm' || unit == 'h')
+    n = pb_hist_since (s, m->from, key,
+		       time (NULL) - n * (unit == 'm' ? 60 : 3600));
+  else
+    n = pb_hist_last (s, m->from, key, n);
+  if (!n) pb_printf (s, "PRIVMSG %s :No history for %s\n", m->from, m->to);
+  return 0;
+}
+
+/* Full-text search. Each term gives the ids of the records containing
+ * it, from the term files and the index in memory. Results are the
+ * intersection, newest first */
+typedef struct pb_ids_t {
+  uint64_t *id;
+  int      n, size;
+} PB_IDS;
+
+int
+pb_ids_decode (PB_IDS *ids, uint8_t *p, uint8_t *end, int after_seg) {
+  uint64_t v, id = 0, *aux;
+
+  while (p < end && (p = pb_varint_get (p, end, &v))) {
+    id += v;
+    if ((int) (id >> 32) <= after_seg) continue;
+    if (ids->n == ids->size) {
+      if ((aux = realloc (ids->id, sizeof(uint64_t) *
+			  (ids->size ? ids->size * 2 : 64))) == NULL) return -1;
+      ids->id = aux;
+      ids->size = ids->size ? ids->size * 2 : 64;
+    }
+    ids->id[ids->n++] = id;
+  }
+  return 0;
+}
+
+/* Ids of a term. Term files may be replaced by a merge while we list
+ * them, so files already covered are skipped */
+void
+pb_search_term (PB_IDS *ids, char *key, char *term) {
+  PB_HIST_MAP  map;
+  PB_TFILE_HDR *t;
+  PB_TFILE_ENT *e;
+  PB_POST      *p;
+  int          seg[PB_TFILE_MAX], n, i, lo, hi, mid, c, covered = -1;
+
+  n = pb_tfile_list (key, seg, PB_TFILE_MAX);
+  for (i = 0; i < n; i++) {
+    if (seg[i] <= covered || !(t = pb_tfile_map (&map, key, seg[i]))) continue;
+    e = (PB_TFILE_ENT*) (t + 1);
+    for (lo = 0, hi = t->n; lo < hi; ) {
+      mid = (lo + hi) / 2;
+      if ((c = strncmp (e[mid].term, term, PB_TERM_MAX)) == 0) {
+	if (e[mid].off + (long) e[mid].len <= map.len)
+	  pb_ids_decode (ids, (uint8_t*) map.p + e[mid].off,
+			 (uint8_t*) map.p + e[mid].off + e[mid].len, covered);
+	break;
+      }
+      if (c < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    covered = t->last;
+    pb_hist_unmap (&map);
+  }
+  pthread_mutex_lock (&hidx_lock);
+  for (i = 0; i < n_hlog; i++)
+    if (!strcmp (hlog[i]->key, key)) {
+      if ((p = pb_tidx_find (&hlog[i]->ti, term, 0)))
+	pb_ids_decode (ids, p->p, p->p + p->len, covered);
+      break;
+    }
+  pthread_mutex_unlock (&hidx_lock);
+}
+
+/* Keeps in a the ids also in b. Both sorted */
+void
+pb_ids_and (PB_IDS *a, PB_IDS *b) {
+  int i = 0, j = 0, n = 0;
+
+  while (i < a->n && j < b->n)
+    if (a->id[i] < b->id[j]) i++;
+    else if (a->id[i] > b->id[j]) j++;
+    else a->id[n++] = a->id[i++], j++;
+  a->n = n;
+}
+
+/* @search [page] words */
+int
+cmd_bot_search (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG  *m = (PB_IRC_MSG*) arg;
+  PB_IDS      ids = {0}, more;
+  PB_HIST_MAP map = {0};
+  char        key[512], term[PB_TERM_MAX], *q, *p, *e;
+  int         page = 1, pages, n = 0, i, k, seg = -1;
+
+  if (!hist_dir) return 0;
+  q = buffer + strlen ("@search");
+  if (sscanf (q, "%d%n", &page, &i) == 1) q += i;
+  for (; *q == ' '; q++);
+  pb_hist_key (key, sizeof(key), s, m->to);
+  for (p = q, e = q + strlen (q); pb_term_next (&p, e, term) > 0; ) {
+    if (strlen (term) < 2) continue;
+    if (n++ == 0) pb_search_term (&ids, key, term);
+    else {
+      memset (&more, 0, sizeof(more));
+      pb_search_term (&more, key, term);
+      pb_ids_and (&ids, &more);
+      free (more.id);
+    }
+    if (!ids.n) break;
+  }
+  if (!n) {
+    pb_printf (s, "PRIVMSG %s :Usage: @search [page] words\n", m->from);
+    return 0;
+  }
+  if (!ids.n) {
+    pb_printf (s, "PRIVMSG %s :No matches for '%s' in %s\n", m->from, q, m->to);
+    free (ids.id);
+    return 0;
+  }
+
+  pages = (ids.n + PB_SEARCH_PAGE - 1) / PB_SEARCH_PAGE;
+  if (page < 1) page = 1;
+  if (page > pages) page = pages;
+  for (k = 0, i = ids.n - 1 - (page - 1) * PB_SEARCH_PAGE;
+       k < PB_SEARCH_PAGE && i >= 0; k++, i--) {
+    if ((int) (ids.id[i] >> 32) != seg) {
+      pb_hist_unmap (&map);
+      seg = ids.id[i] >> 32;
+      if (pb_hist_map (&map, key, seg, "log") < 0) continue;
+    }
+    if (!map.p || (p = map.p + (uint32_t) ids.id[i]) >= map.p + map.len ||
+	!(e = memchr (p, '\n', map.p + map.len - p))) continue;
+    pb_hist_send (s, m->from, p, e);
+  }
+  pb_hist_unmap (&map);
+  pb_printf (s, "PRIVMSG %s :%d matches. Page %d/%d%s\n", m->from, ids.n,
+	     page, pages, page < pages ? ". @search <page> words for more" : "");
+  free (ids.id);
+  return 0;
+}
+
+/* Last-seen database. Updates are plain stores into the mapping and
+ * the kernel writes them back. On restart the file is just mapped
+ * again. Nicks are casemapped and scoped by network */
+long
+pb_seen_len (int slots) {
+  return sizeof(PB_SEEN_HDR) + (long) slots * sizeof(PB_SEEN);
+}
+
+PB_SEEN_HDR *
+pb_seen_map (char *path, int slots) {
+  PB_SEEN_HDR *h;
+  struct stat st;
+  int         fd;
+
+  if ((fd = open (path, O_RDWR | O_CREAT, 0644)) < 0) return NULL;
+  if (fstat (fd, &st) < 0) goto fail;
+  if (st.st_size == 0 && ftruncate (fd, pb_seen_len (slots)) < 0) goto fail;
+  else if (st.st_size) {
+    if (st.st_size < sizeof(PB_SEEN_HDR) ||
+	pread (fd, &slots, sizeof(slots), offsetof (PB_SEEN_HDR, slots)) < 0 ||
+	slots < 1 || (slots & (slots - 1)) || st.st_size != pb_seen_len (slots)) {
+      fprintf (stderr, "E: '%s' is not a seen database\n", path);
+      goto fail;
+    }
+  }
+  h = mmap (NULL, pb_seen_len (slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (h == MAP_FAILED) return NULL;
+  if (h->magic != PB_SEEN_MAGIC) {
+    if (h->magic || h->slots) {
+      fprintf (stderr, "E: '%s' is not a seen database\n", path);
+      munmap (h, pb_seen_len (slots));
+      return NULL;
+    }
+    h->magic = PB_SEEN_MAGIC;
+    h->slots = slots;
+  }
+  return h;
+
+ fail:
+  close (fd);
+  return NULL;
+}
+
+uint32_t
+pb_seen_hash (char *net, char *nick) {
+  uint32_t h = pb_irc_nick_hash (nick);
+
+  for (; *net; net++) h = (h ^ *net) * 16777619u;
+  return h ? h : 1;
+}
+
+/* Finds the slot of a nick. With add, a free slot if not there */
+PB_SEEN *
+pb_seen_slot (PB_SEEN_HDR *h, char *net1, char *nick, int add) {
+  PB_SEEN  *t = (PB_SEEN*) (h + 1);
+  char     net[sizeof(t->net)];
+  uint32_t hash, mask = h->slots - 1, i;
+
+  // Keyed by the network name as stored. Longer ones are truncated
+  snprintf (net, sizeof(net), "%s", net1);
+  hash = pb_seen_hash (net, nick);
+  for (i = hash & mask; t[i].hash; i = (i + 1) & mask)
+    if (t[i].hash == hash && !strcmp (t[i].net, net) &&
+	!pb_irc_casecmp (t[i].nick, nick)) return &t[i];
+  if (!add) return NULL;
+  t[i].hash = hash;
+  h->used++;
+  return &t[i];
+}
+
+/* Doubles the table into a new file that replaces the old one */
+int
+pb_seen_grow (void) {
+  PB_SEEN_HDR *h;
+  PB_SEEN     *t = (PB_SEEN*) (seen + 1), *e;
+  char        tmp[PATH_MAX + 5];
+  uint32_t    i;
+
+  if (snprintf (tmp, sizeof(tmp), "%s.new", seen_path) >= sizeof(tmp)) return -1;
+  unlink (tmp);
+  if ((h = pb_seen_map (tmp, seen->slots * 2)) == NULL) return -1;
+  for (i = 0; i < seen->slots; i++)
+    if (t[i].hash) {
+      e = pb_seen_slot (h, t[i].net, t[i].nick, 1);
+      *e = t[i];
+    }
+  if (rename (tmp, seen_path) < 0) {
+    munmap (h, pb_seen_len (h->slots));
+    unlink (tmp);
+    return -1;
+  }
+  fprintf (stderr, "I: Seen database grown to %u slots\n", h->slots);
+  munmap (seen, pb_seen_len (seen->slots));
+  seen = h;
+  return 0;
+}
+
+int
+pb_seen_init (void) {
+  if (!seen_path) return 0;
+  while (seen_slots & (seen_slots - 1)) seen_slots &= seen_slots - 1;
+  if (seen_slots < 16) seen_slots = 16;
+  if ((seen = pb_seen_map (seen_path, seen_slots)) == NULL) {
+    perror ("pb_seen_init:");
+    return -1;
+  }
+  fprintf (stderr, "I: Seen database '%s': %u/%u slots used\n",
+	   seen_path, seen->used, seen->slots);
+  return 0;
+}
+
+void
+pb_seen_update (PB_SESSION *s, PB_IRC_MSG *m, char *what, char *chan) {
+  PB_SEEN *e;
+  char    nick[sizeof(e->nick)], *net;
+
+  if (!seen || !*m->from) return;
+  // Keep load under 3/4. If we cannot grow, keep going until full
+  if (seen->used * 4 >= seen->slots * 3 && pb_seen_grow () < 0 &&
+      seen->used == seen->slots - 1) return;
+  net = s->bot ? s->bot->net->name : s->host;
+  snprintf (nick, sizeof(nick), "%s", m->from);
+  e = pb_seen_slot (seen, net, nick, 1);
+  e->time = m->time;
+  snprintf (e->net, sizeof(e->net), "%s", net);
+  snprintf (e->nick, sizeof(e->nick), "%s", nick);
+  snprintf (e->chan, sizeof(e->chan), "%s", chan ? chan : "");
+  snprintf (e->what, sizeof(e->what), "%s", what);
+  snprintf (e->text, sizeof(e->text), "%s", m->pars ? m->pars : "");
+}
+
+/* @seen nick */
+int
+cmd_bot_seen (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  PB_SEEN    *e;
+  char       nick[sizeof(e->nick)], ago[32];
+  long       t;
+
+  if (!seen) return 0;
+  if (sscanf (buffer + strlen ("@seen"), "%31s", nick) != 1) {
+    pb_printf (s, "PRIVMSG %s :Usage: @seen nick\n", m->to);
+    return 0;
+  }
+  if (!(e = pb_seen_slot (seen, s->bot ? s->bot->net->name : s->host,
+			  nick, 0))) {
+    pb_printf (s, "PRIVMSG %s :I have not seen %s\n", m->to, nick);
+    return 0;
+  }
+  if ((t = time (NULL) - e->time) < 0) t = 0;
+  if (t < 60) snprintf (ago, sizeof(ago), "%lds", t);
+  else if (t < 3600) snprintf (ago, sizeof(ago), "%ldm", t / 60);
+  else if (t < 86400) snprintf (ago, sizeof(ago), "%ldh %ldm", t / 3600, t / 60 % 60);
+  else snprintf (ago, sizeof(ago), "%ldd %ldh", t / 86400, t / 3600 % 24);
+
+  if (!strcmp (e->what, "privmsg"))
+    pb_printf (s, "PRIVMSG %s :%s was seen %s ago in %s saying: %s\n",
+	       m->to, e->nick, ago, e->chan, e->text);
+  else if (!strcmp (e->what, "quit"))
+    pb_printf (s, "PRIVMSG %s :%s quit %s ago (%s)\n",
+	       m->to, e->nick, ago, e->text);
+  else
+    pb_printf (s, "PRIVMSG %s :%s was seen %s ago %sing %s\n",
+	       m->to, e->nick, ago, e->what, e->chan);
+  return 0;
+}
+
+/* Flood detection. Messages per sender are counted in a count-min
+ * sketch, one per sub-window of the sliding window, so memory does not
+ * depend on how many nicks we see. The estimate may be high, never
+ * low. Senders over the limit are ignored until they slow down */
+int
+pb_flood_check (PB_SESSION *s, char *nick) {
+  long long tick;
+  uint32_t  h, h2, i;
+  int       r, k, sum, est = 0;
+
+  if (flood_msgs <= 0) return 0;
+  // Expire the sub-windows left behind
+  tick = pb_now_ms () / (flood_win / PB_FLOOD_SLOTS);
+  if (tick - flood_tick > PB_FLOOD_SLOTS) flood_tick = tick - PB_FLOOD_SLOTS;
+  while (flood_tick < tick)
+    memset (flood[++flood_tick % PB_FLOOD_SLOTS], 0, sizeof(flood[0]));
+
+  // Row hashes derived from one (Kirsch-Mitzenmacher)
+  h = pb_seen_hash (s->bot ? s->bot->net->name : s->host, nick);
+  h2 = ((h >> 16) | (h << 16)) * 0x9e3779b1u | 1;
+  for (r = 0; r < PB_FLOOD_ROWS; r++) {
+    i = (h + r * h2) & (PB_FLOOD_COLS - 1);
+    if (flood[tick % PB_FLOOD_SLOTS][r][i] < UINT16_MAX)
+      flood[tick % PB_FLOOD_SLOTS][r][i]++;
+    for (sum = k = 0; k < PB_FLOOD_SLOTS; k++) sum += flood[k][r][i];
+    if (r == 0 || sum < est) est = sum;
+  }
+  if (est <= flood_msgs) return 0;
+  if (est == flood_msgs + 1)
+    fprintf (stderr, "W: Flood from '%s'. Ignoring it\n", nick);
+  flood_ignored++;
+  return 1;
+}
+
+/* DCC SEND. @get offers a file from dcc_dir on a new listening socket
+ * and the peer connects to it. The file goes out with sendfile as the
+ * socket drains, within a per transfer and a global rate cap (token
+ * buckets). Throttled transfers stop polling for POLLOUT until the
+ * scheduler wakes them up */
+void
+pb_dcc_free (PB_DCC *d) {
+  close (d->fd);
+  free (d->name);
+  free (d->nick);
+  free (d);
+  n_dcc--;
+}
+
+/* Refills a bucket and returns the bytes in it. Bursts up to 1/4 s */
+double
+pb_dcc_bucket (double *tok, long long *last, long rate, long long now) {
+  double cap = rate / 4 > BSIZE ? rate / 4 : BSIZE;
+
+  if (!rate) return PB_DCC_CHUNK;
+  *tok += (now - *last) * rate / 1000.0;
+  *last = now;
+  if (*tok > cap) *tok = cap;
+  return *tok;
+}
+
+int
+pb_dcc_send (PB_SESSION *s, char *buffer) {
+  PB_DCC    *d = s->dcc;
+  long long now = pb_now_ms ();
+  double    a, g;
+  long      need;
+  int       n, i;
+
+  // Acks. 32 bit counts of the bytes received
+  while ((n = read (s->fd, buffer, BSIZE)) > 0)
+    for (i = 0; i < n; i++) {
+      d->abuf = d->abuf << 8 | (unsigned char) buffer[i];
+      if (++d->alen == 4) {
+	d->ack = d->abuf;
+	d->alen = 0;
+      }
+    }
+  if (n == 0 || (n < 0 && errno != EAGAIN) ||
+      (d->off == d->size && d->ack == (uint32_t) d->size)) {
+    fprintf (stderr, "I: DCC '%s' to %s %s (%lld/%lld bytes)\n", d->name,
+	     d->nick, d->off == d->size ? "done" : "aborted",
+	     (long long) d->off, (long long) d->size);
+    return -1;
+  }
+  if (d->off == d->size) {
+    pfd[s - ses].events = POLLIN; // Wait for the last ack
+    return 0;
+  }
+
+  a = pb_dcc_bucket (&d->tok, &d->last, dcc_rate, now);
+  g = pb_dcc_bucket (&dcc_tok, &dcc_last, dcc_total, now);
+  if (g < a) a = g;
+  need = d->size - d->off < BSIZE ? d->size - d->off : BSIZE;
+  if (a < need) {
+    // Wait for the slowest bucket to get a block
+    d->wake = now + 1;
+    if (dcc_rate && d->tok < need)
+      d->wake = now + 1 + (need - d->tok) * 1000 / dcc_rate;
+    if (dcc_total && dcc_tok < need &&
+	now + 1 + (need - dcc_tok) * 1000 / dcc_total > d->wake)
+      d->wake = now + 1 + (need - dcc_tok) * 1000 / dcc_total;
+    pfd[s - ses].events = POLLIN;
+    return 0;
+  }
+  if ((n = sendfile (s->fd, d->fd, &d->off, a > PB_DCC_CHUNK ? PB_DCC_CHUNK : a)) < 0)
+    return errno == EAGAIN ? 0 : -1;
+  if (dcc_rate) d->tok -= n;
+  if (dcc_total) dcc_tok -= n;
+  pfd[s - ses].events = POLLIN | POLLOUT;
+  return 0;
+}
+
+/* The peer connected. The transfer moves to the new socket and the
+ * listening one is closed */
+int
+pb_dcc_accept (PB_SESSION *s, char *buffer) {
+  PB_DCC             *d = s->dcc;
+  struct sockaddr_in a;
+  socklen_t          alen = sizeof(a);
+  int                cfd, i;
+
+  if ((cfd = accept4 (s->fd, (struct sockaddr*) &a, &alen, SOCK_NONBLOCK)) < 0)
+    return 0;
+  // Only the requester, when its host tells us its address
+  if (d->peer && a.sin_addr.s_addr != d->peer) {
+    fprintf (stderr, "W: DCC '%s' for %s refused to %s\n", d->name, d->nick,
+	     inet_ntoa (a.sin_addr));
+    close (cfd);
+    return 0;
+  }
+  if ((i = pb_add_fd (cfd)) < 0) {
+    close (cfd);
+    return 0;
+  }
+  ses[i].func = pb_dcc_send;
+  ses[i].host = strdup ("dcc");
+  ses[i].nick = strdup (d->nick);
+  ses[i].master = strdup ("N/A");
+  ses[i].dcc = d;
+  s->dcc = NULL;
+  d->tok = 0;
+  d->last = pb_now_ms ();
+  pfd[i].events = POLLIN | POLLOUT;
+  fprintf (stderr, "I: DCC '%s' to %s from offset %lld\n", d->name, d->nick,
+	   (long long) d->off);
+  return -1;
+}
+
+/* Expires offers and wakes up throttled transfers */
+long long
+pb_dcc_run (long long now, long long tmo) {
+  PB_DCC *d;
+  int    i;
+
+  for (i = 0; i < MAX_CONN && n_dcc; i++) {
+    if (!(d = ses[i].dcc)) continue;
+    if (ses[i].func == pb_dcc_accept && d->expire <= now) {
+      fprintf (stderr, "I: DCC offer of '%s' to %s expired\n", d->name, d->nick);
+      pd_del_index (i);
+    }
+    else if (d->wake && d->wake <= now) {
+      d->wake = 0;
+      pfd[i].events = POLLIN | POLLOUT;
+    }
+    else if (d->wake && d->wake - now < tmo) tmo = d->wake - now;
+  }
+  return tmo;
+}
+
+/* @get file */
+int
+cmd_bot_get (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG         *m = (PB_IRC_MSG*) arg;
+  PB_DCC             *d;
+  struct sockaddr_in a, l;
+  socklen_t          alen = sizeof(a);
+  struct stat        st;
+  in_addr_t          bind_ip;
+  char               name[256], path[1024], *host;
+  int                fd, lfd, i;
+
+  if (!dcc_dir) return 0;
+  if (sscanf (buffer + strlen ("@get"), " %255[^\r\n]", name) != 1 ||
+      name[0] == '.' || strchr (name, '/')) {
+    pb_printf (s, "PRIVMSG %s :Usage: @get file\n", m->from);
+    return 0;
+  }
+  if (n_dcc >= PB_DCC_MAX) {
+    pb_printf (s, "PRIVMSG %s :Too many transfers. Try later\n", m->from);
+    return 0;
+  }
+  snprintf (path, sizeof(path), "%s/%s", dcc_dir, name);
+  if ((fd = open (path, O_RDONLY | O_NOFOLLOW)) < 0 || fstat (fd, &st) < 0 ||
+      !S_ISREG (st.st_mode)) {
+    if (fd >= 0) close (fd);
+    pb_printf (s, "PRIVMSG %s :No such file '%s'\n", m->from, name);
+    return 0;
+  }
+  // Address the peer connects to. Ours on the IRC connection by default.
+  // The listener is bound to that one, as behind NAT dcc_ip is not ours.
+  // dcc_ip is checked by pb_config_load
+  if (getsockname (s->fd, (struct sockaddr*) &a, &alen) < 0 || a.sin_family != AF_INET) {
+    if (!dcc_ip) {
+      fprintf (stderr, "E: DCC needs an IPv4 address. Set dcc_ip\n");
+      close (fd);
+      return 0;
+    }
+    inet_pton (AF_INET, dcc_ip, &a.sin_addr);
+  }
+  bind_ip = a.sin_addr.s_addr;
+  if (dcc_ip) inet_pton (AF_INET, dcc_ip, &a.sin_addr);
+  if ((lfd = pb_server_addr (bind_ip, 0)) < 0 || (i = pb_add_fd (lfd)) < 0) {
+    if (lfd >= 0) close (lfd);
+    close (fd);
+    return 0;
+  }
+  pb_set_blocking (lfd, 0);
+  d = calloc (1, sizeof(PB_DCC));
+  d->fd = fd;
+  d->name = strdup (name);
+  d->nick = strdup (m->from);
+  if (!m->user || !(host = strchr (m->user, '@')) ||
+      inet_pton (AF_INET, host + 1, &d->peer) != 1)
+    d->peer = 0;
+  d->size = st.st_size;
+  d->expire = pb_now_ms () + PB_DCC_TMO;
+  alen = sizeof(l);
+  getsockname (lfd, (struct sockaddr*) &l, &alen);
+  d->port = ntohs (l.sin_port);
+  n_dcc++;
+  ses[i].func = pb_dcc_accept;
+  ses[i].host = strdup ("dcc");
+  ses[i].nick = strdup (m->from);
+  ses[i].master = strdup ("N/A");
+  ses[i].dcc = d;
+
+  pb_printf (s, "PRIVMSG %s :\001DCC SEND \"%s\" %u %d %lld\001\n", m->from,
+	     name, ntohl (a.sin_addr.s_addr), d->port, (long long) d->size);
+  return 0;
+}
+
+/* CTCP DCC RESUME file port position. The peer has part of the file */
+int
+pb_dcc_resume (PB_SESSION *s, PB_IRC_MSG *m) {
+  PB_DCC    *d;
+  int       i, port;
+  long long pos;
+
+  if (sscanf (m->pars, "\001DCC RESUME %*s %d %lld", &port, &pos) != 2)
+    return 0;
+  for (i = 0; i < MAX_CONN; i++)
+    if ((d = ses[i].dcc) && ses[i].func == pb_dcc_accept && d->port == port &&
+	!pb_irc_casecmp (d->nick, m->from)) {
+      if (pos < 0 || pos > d->size) return 0;
+      d->off = pos;
+      pb_printf (s, "PRIVMSG %s :\001DCC ACCEPT \"%s\" %d %lld\001\n",
+		 m->from, d->name, port, pos);
+      return 1;
+    }
+  return 0;
+}
+
+/* Factoids. The database is mapped at startup without reading it.
+ * Pages come in as lookups touch them. A lookup folds the key on the
+ * stack, takes the fence range of its first two bytes and does a
+ * binary search there */
+int
+pb_fact_fold (char *out, char *key) {
+  int n;
+
+  for (n = 0; key[n] && n < PB_FACT_KEY - 1; n++)
+    out[n] = (key[n] >= 'A' && key[n] <= 'Z') ? key[n] + 32 : key[n];
+  out[n] = 0;
+  return n;
+}
+
+int
+pb_fact_fence (char *fkey) {
+  return (unsigned char) fkey[0] << 8 | (fkey[0] ? (unsigned char) fkey[1] : 0);
+}
+
+int
+pb_fact_init (void) {
+  struct stat st;
+  int         fd;
+
+  if (!fact_path) return 0;
+  if ((fd = open (fact_path, O_RDONLY)) < 0 || fstat (fd, &st) < 0) {
+    perror ("pb_fact_init:");
+    if (fd >= 0) close (fd);
+    return -1;
+  }
+  fact = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (fact == MAP_FAILED || st.st_size < sizeof(PB_FACT_HDR) ||
+      fact->magic != PB_FACT_MAGIC || st.st_size < sizeof(PB_FACT_HDR) +
+      (long) fact->n * sizeof(PB_FACT_ENT)) {
+    fprintf (stderr, "E: '%s' is not a factoid database\n", fact_path);
+    if (fact != MAP_FAILED) munmap (fact, st.st_size);
+    fact = NULL;
+    return -1;
+  }
+  fact_len = st.st_size;
+  madvise (fact, fact_len, MADV_RANDOM);
+  fprintf (stderr, "I: %u factoids in '%s'\n", fact->n, fact_path);
+  return 0;
+}
+
+/* Value of a key or NULL. Points into the mapping */
+char *
+pb_fact_get (char *key) {
+  PB_FACT_ENT *e = (PB_FACT_ENT*) (fact + 1);
+  char        fkey[PB_FACT_KEY], pfx[8];
+  int         lo, hi, mid, c, f;
+
+  if (!fact) return NULL;
+  pb_fact_fold (fkey, key);
+  strncpy (pfx, fkey, sizeof(pfx));
+  f = pb_fact_fence (fkey);
+  for (lo = fact->fence[f], hi = fact->fence[f + 1]; lo < hi; ) {
+    mid = (lo + hi) / 2;
+    if ((c = memcmp (e[mid].pfx, pfx, sizeof(pfx))) == 0) {
+      if (e[mid].key >= fact_len || e[mid].val >= fact_len) return NULL;
+      if ((c = strncmp ((char*) fact + e[mid].key, fkey,
+			fact_len - e[mid].key)) == 0)
+	return (char*) fact + e[mid].val;
+    }
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return NULL;
+}
+
+/* !fact key */
+int
+cmd_bot_fact (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  char       *key, *val;
+
+  if (!fact) return 0;
+  for (key = buffer + strlen ("!fact"); *key == ' '; key++);
+  if (!*key)
+    pb_printf (s, "PRIVMSG %s :Usage: !fact key\n", m->to);
+  else if ((val = pb_fact_get (key)))
+    pb_printf (s, "PRIVMSG %s :%s: %.*s\n", m->to, key, PB_FACT_VAL, val);
+  else
+    pb_printf (s, "PRIVMSG %s :I know nothing about %s\n", m->to, key);
+  return 0;
+}
+
+/* Async handlers. A handler sends a query and suspends with pb_await.
+ * When a matching numeric arrives on the session its continuation
+ * runs. A wait is a small struct in a per session list, so thousands
+ * of them cost little */
+PB_AWAIT *
+pb_await (PB_SESSION *s, char *key, char *num, PB_AWAIT_F f, char *to,
+	  void *data) {
+  PB_AWAIT *w, **pw;
+
+  if (s->n_await >= PB_AWAIT_MAX || !(w = calloc (1, sizeof(PB_AWAIT))))
+    return NULL;
+  w->key = strdup (key);
+  w->num = num;
+  w->f = f;
+  w->to = strdup (to);
+  w->data = data;
+  w->expire = pb_now_ms () + PB_AWAIT_TMO;
+  for (pw = &s->await; *pw; pw = &(*pw)->next);
+  *pw = w;
+  s->n_await++;
+  n_await++;
+  return w;
+}
+
+void
+pb_await_free (PB_SESSION *s, PB_AWAIT *w) {
+  free (w->key);
+  free (w->to);
+  free (w->data);
+  free (w);
+  s->n_await--;
+  n_await--;
+}
+
+void
+pb_await_free_all (PB_SESSION *s) {
+  PB_AWAIT *w;
+
+  while ((w = s->await)) {
+    s->await = w->next;
+    pb_await_free (s, w);
+  }
+}
+
+// Whether cmd is one of the space separated numerics of list
+int
+pb_await_num (char *list, char *cmd) {
+  int len = strlen (cmd), l;
+
+  while (*list) {
+    l = strcspn (list, " ");
+    if (l == len && !strncmp (list, cmd, len)) return 1;
+    for (list += l; *list == ' '; list++);
+  }
+  return 0;
+}
+
+/* Resumes the handlers waiting for this reply, oldest first. Handlers
+ * waiting for the same query all see its replies */
+int
+pb_await_run (PB_SESSION *s, PB_IRC_MSG *m) {
+  PB_AWAIT **pw, *w;
+  int      n = 0;
+
+  if (m->argc < 2) return 0;
+  for (pw = &s->await; (w = *pw); )
+    if (pb_await_num (w->num, m->cmd) && !pb_irc_casecmp (w->key, m->arg[1])) {
+      n++;
+      if (w->f (s, m, w) == PB_AWAIT_DONE) {
+	*pw = w->next;
+	pb_await_free (s, w);
+      }
+      else pw = &w->next;
+    }
+    else pw = &w->next;
+  return n;
+}
+
+/* Times out waits. Their continuation runs with no message */
+long long
+pb_await_expire (long long now, long long tmo) {
+  PB_AWAIT **pw, *w;
+  int      i;
+
+  for (i = 0; i < MAX_CONN && n_await; i++)
+    for (pw = &ses[i].await; (w = *pw); )
+      if (w->expire <= now) {
+	w->f (&ses[i], NULL, w);
+	*pw = w->next;
+	pb_await_free (&ses[i], w);
+	if (ses[i].olen) pfd[i].events |= POLLOUT; // Not flushed by the loop
+      }
+      else {
+	if (w->expire - now < tmo) tmo = w->expire - now;
+	pw = &w->next;
+      }
+  return tmo;
+}
+
+/* WHOIS/WHO cache. Entries live TTL ms and are dropped when the nick
+ * changes or quits. Lookups of a nick with a query in flight wait for
+ * that query instead of sending another one. The numeric handlers in
+ * irc_cm fill the entries. RPL_WHOREPLY lines fill them too */
+unsigned int
+pb_whois_bucket (PB_SESSION *s, char *nick) {
+  return pb_irc_nick_hash (nick) & (s->s_whois - 1);
+}
+
+PB_WHOIS *
+pb_whois_find (PB_SESSION *s, char *nick) {
+  PB_WHOIS *e;
+
+  if (!s->s_whois) return NULL;
+  for (e = s->whois[pb_whois_bucket (s, nick)]; e; e = e->next)
+    if (!pb_irc_casecmp (e->nick, nick)) return e;
+  return NULL;
+}
+
+void
+pb_whois_clear (PB_WHOIS *e) {
+  free (e->user);
+  free (e->host);
+  free (e->real);
+  free (e->server);
+  free (e->chans);
+  e->user = e->host = e->real = e->server = e->chans = NULL;
+  e->idle = -1;
+  e->stale = 0;
+}
+
+void
+pb_whois_set (char **field, char *val) {
+  free (*field);
+  *field = strdup (val);
+}
+
+/* Removes the entries in the chain at pe matching nick or, with nick
+ * NULL, the expired ones */
+void
+pb_whois_unlink (PB_SESSION *s, PB_WHOIS **pe, char *nick, long long now) {
+  PB_WHOIS *e;
+
+  while ((e = *pe))
+    if (nick ? !pb_irc_casecmp (e->nick, nick) :
+	(e->state != PB_WHOIS_PENDING && e->expire <= now)) {
+      *pe = e->next;
+      pb_whois_clear (e);
+      free (e->nick);
+      free (e);
+      s->n_whois--;
+    }
+    else pe = &e->next;
+}
+
+void
+pb_whois_free_all (PB_SESSION *s) {
+  PB_WHOIS *e;
+  int      i;
+
+  for (i = 0; i < s->s_whois; i++)
+    while ((e = s->whois[i])) {
+      s->whois[i] = e->next;
+      pb_whois_clear (e);
+      free (e->nick);
+      free (e);
+    }
+  free (s->whois);
+  s->whois = NULL;
+  s->s_whois = s->n_whois = 0;
+}
+
+PB_WHOIS *
+pb_whois_add (PB_SESSION *s, char *nick) {
+  PB_WHOIS **aux, *e;
+  int      i, size;
+  unsigned h;
+
+  if (s->n_whois >= PB_WHOIS_MAX)
+    for (i = 0; i < s->s_whois; i++)
+      pb_whois_unlink (s, &s->whois[i], NULL, pb_now_ms ());
+  if (s->n_whois >= s->s_whois) {
+    size = s->s_whois ? s->s_whois * 2 : 16;
+    if ((aux = calloc (size, sizeof(PB_WHOIS*))) == NULL) return NULL;
+    for (i = 0; i < s->s_whois; i++)
+      while ((e = s->whois[i])) {
+	s->whois[i] = e->next;
+	h = pb_irc_nick_hash (e->nick) & (size - 1);
+	e->next = aux[h];
+	aux[h] = e;
+      }
+    free (s->whois);
+    s->whois = aux;
+    s->s_whois = size;
+  }
+  if ((e = calloc (1, sizeof(PB_WHOIS))) == NULL) return NULL;
+  e->nick = strdup (nick);
+  e->idle = -1;
+  h = pb_whois_bucket (s, nick);
+  e->next = s->whois[h];
+  s->whois[h] = e;
+  s->n_whois++;
+  // Over the limit with nothing expired: serve this one but do not keep it
+  e->stale = s->n_whois > PB_WHOIS_MAX;
+  return e;
+}
+
+/* NICK and QUIT. Entries with a query in flight are kept for the
+ * handlers waiting on them but not cached */
+void
+pb_whois_invalidate (PB_SESSION *s, char *nick) {
+  PB_WHOIS *e;
+
+  if (!(e = pb_whois_find (s, nick))) return;
+  if (e->state == PB_WHOIS_PENDING) e->stale = 1;
+  else pb_whois_unlink (s, &s->whois[pb_whois_bucket (s, nick)], nick, 0);
+}
+
+/* Numeric replies: 311 312 317 319 352 fill, 318 401 end */
+int
+cmd_irc_whois (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  PB_WHOIS   *e;
+  char       *nick = m->argc > 1 ? m->arg[1] : NULL, *aux;
+  long long  now = pb_now_ms ();
+
+  // 352 me channel user host server nick flags :hops realname
+  if (!strcmp (m->cmd, "352")) {
+    if (m->argc < 8) return 0;
+    nick = m->arg[5];
+    if (!(e = pb_whois_find (s, nick))) {
+      if (!(e = pb_whois_add (s, nick))) return 0;
+      e->state = PB_WHOIS_OK;
+    }
+    pb_whois_set (&e->user, m->arg[2]);
+    pb_whois_set (&e->host, m->arg[3]);
+    pb_whois_set (&e->server, m->arg[4]);
+    pb_whois_set (&e->real, strchr (m->arg[7], ' ') ? strchr (m->arg[7], ' ') + 1 : "");
+    if (e->state != PB_WHOIS_PENDING) {
+      e->state = PB_WHOIS_OK;
+      e->expire = e->stale ? 0 : now + whois_ttl;
+    }
+    return 0;
+  }
+  if (!nick || !(e = pb_whois_find (s, nick))) return 0;
+  if (!strcmp (m->cmd, "311") && m->argc > 5) {
+    pb_whois_set (&e->user, m->arg[2]);
+    pb_whois_set (&e->host, m->arg[3]);
+    pb_whois_set (&e->real, m->arg[5]);
+  }
+  else if (!strcmp (m->cmd, "312") && m->argc > 2)
+    pb_whois_set (&e->server, m->arg[2]);
+  else if (!strcmp (m->cmd, "317") && m->argc > 2)
+    e->idle = atol (m->arg[2]);
+  else if (!strcmp (m->cmd, "319") && m->argc > 2) {
+    if (!e->chans) pb_whois_set (&e->chans, m->arg[2]);
+    else if ((aux = realloc (e->chans, strlen (e->chans) + strlen (m->arg[2]) + 2))) {
+      e->chans = aux;
+      strcat (strcat (e->chans, " "), m->arg[2]);
+    }
+  }
+  else if (!strcmp (m->cmd, "318") || !strcmp (m->cmd, "401")) {
+    if (e->state != PB_WHOIS_PENDING) return 0;
+    e->state = m->cmd[0] == '3' && e->user ? PB_WHOIS_OK : PB_WHOIS_NONE;
+    e->expire = e->stale ? 0 :
+      now + (e->state == PB_WHOIS_OK ? whois_ttl : PB_WHOIS_NEG);
+  }
+  return 0;
+}
+
+/* Runs when the query a lookup waits on ends or times out */
+int
+pb_whois_cont (PB_SESSION *s, PB_IRC_MSG *m, PB_AWAIT *w) {
+  PB_WHOIS *e = m ? pb_whois_find (s, w->key) : NULL;
+
+  ((PB_WHOIS_F) w->arg) (s, e && e->state != PB_WHOIS_PENDING ? e : NULL,
+			 w->key, w->to);
+  return PB_AWAIT_DONE;
+}
+
+/* Calls f with the info about nick. Right away from the cache or when
+ * the query in flight ends. f gets NULL if there is no answer */
+int
+pb_whois_get (PB_SESSION *s, char *nick, PB_WHOIS_F f, char *to) {
+  PB_WHOIS  *e = pb_whois_find (s, nick);
+  PB_AWAIT  *w;
+  long long now = pb_now_ms ();
+
+  if (e && e->state != PB_WHOIS_PENDING && e->expire > now) {
+    f (s, e, nick, to);
+    return 0;
+  }
+  if (!(w = pb_await (s, nick, "318 401", pb_whois_cont, to, NULL))) return -1;
+  w->arg = f;
+  if (e && e->state == PB_WHOIS_PENDING && e->expire > now) return 0;
+
+  // Not there, expired or its query got lost
+  if (!e && !(e = pb_whois_add (s, nick))) return -1;
+  pb_whois_clear (e);
+  e->state = PB_WHOIS_PENDING;
+  e->expire = now + PB_AWAIT_TMO;
+  pb_printf (s, "WHOIS %s\n", nick);
+  return 0;
+}
+
+void
+pb_whois_reply (PB_SESSION *s, PB_WHOIS *e, char *nick, char *to) {
+  if (!e)
+    pb_printf (s, "PRIVMSG %s :No answer about %s\n", to, nick);
+  else if (e->state == PB_WHOIS_NONE)
+    pb_printf (s, "PRIVMSG %s :No such nick %s\n", to, nick);
+  else {
+    pb_printf (s, "PRIVMSG %s :%s is %s@%s (%s)\n", to, e->nick,
+	       e->user, e->host ? e->host : "?", e->real ? e->real : "");
+    if (e->chans)
+      pb_printf (s, "PRIVMSG %s :%s is on %s\n", to, e->nick, e->chans);
+    if (e->server)
+      pb_printf (s, "PRIVMSG %s :%s is using %s\n", to, e->nick, e->server);
+    if (e->idle >= 0)
+      pb_printf (s, "PRIVMSG %s :%s has been idle %lds\n", to, e->nick, e->idle);
+  }
+}
+
+/* @whois nick */
+int
+cmd_bot_whois (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  char       nick[64];
+
+  if (sscanf (buffer + strlen ("@whois"), "%63s", nick) != 1 ||
+      strpbrk (nick, ",*?")) {
+    pb_printf (s, "PRIVMSG %s :Usage: @whois nick\n", m->to);
+    return 0;
+  }
+  pb_whois_get (s, nick, pb_whois_reply, m->to);
+  return 0;
+}
+
+/* Low latency mode. Replies go out without waiting for Nagle or
+ * delayed ACKs (TCP_QUICKACK is not sticky, so it is set again after
+ * each read). The loop spins on poll for lowlat_spin us before
+ * blocking, and the kernel may busy poll the device queue for the
+ * same time (SO_BUSY_POLL, needs CAP_NET_ADMIN). Loop threads can be
+ * pinned to CPUs */
+void
+pb_lowlat_sock (int fd) {
+  int on = 1;
+
+  if (!lowlat) return;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt (fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+  if (lowlat_spin)
+    setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &lowlat_spin, sizeof(int));
+}
+
+/* Pins a loop thread. Loop n gets the n-th CPU of the list */
+int
+pb_lowlat_pin (pthread_t t, int n) {
+  cpu_set_t set;
+
+  if (!lowlat || !n_lowlat_cpu) return 0;
+  CPU_ZERO (&set);
+  CPU_SET (lowlat_cpu[n % n_lowlat_cpu], &set);
+  if ((errno = pthread_setaffinity_np (t, sizeof(set), &set))) {
+    perror ("pb_lowlat_pin:");
+    return -1;
+  }
+  return 0;
+}
+
+/* Loop memory that lives as long as the process. Chunks are
+ * PB_ARENA bytes, aligned so they can be one huge page. With
+ * "hugepages 1" they ask for transparent huge pages */
+void *
+pb_arena_alloc (int size) {
+  char *p, *a;
+
+  size = (size + 63) & ~63;
+  if (size > PB_ARENA) return NULL;
+  if (!arena || arena_used + size > PB_ARENA) {
+    if ((p = mmap (NULL, 2 * PB_ARENA, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+      perror ("pb_arena_alloc:");
+      return NULL;
+    }
+    a = (char*) (((uintptr_t) p + PB_ARENA - 1) & ~((uintptr_t) PB_ARENA - 1));
+    if (a > p) munmap (p, a - p);
+    munmap (a + PB_ARENA, p + PB_ARENA - a);
+    if (hugepages) madvise (a, PB_ARENA, MADV_HUGEPAGE);
+    arena = a;
+    arena_used = 0;
+  }
+  p = arena + arena_used;
+  arena_used += size;
+  return p;
+}
+
+long long
+pb_now_us (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* poll, spinning first in low latency mode */
+int
+pb_poll (struct pollfd *p, int n, int tmo) {
+  long long end;
+  int       r;
+
+  if (lowlat && lowlat_spin && tmo) {
+    end = pb_now_us () + lowlat_spin;
+    do {
+      if ((r = poll (p, n, 0)) != 0) return r;
+    } while (pb_now_us () < end);
+  }
+  return poll (p, n, tmo);
+}
+
+/* Actions on IRC messages */
+int
+cmd_irc_join (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  PB_CHAN    *c;
+
+  if (!m->argc) return 0;
+  pb_seen_update (s, m, "join", m->to);
+  if (!pb_irc_casecmp (m->from, s->nick)) {
+    pb_chan_add (s, m->to);
+    return 0;
+  }
+  // With extended-join: JOIN #channel account :realname
+  if ((c = pb_chan_find (s, m->to)))
+    pb_chan_member_add (c, m->from, (s->caps & PB_CAP_EXTENDED_JOIN) &&
+			m->argc > 2 ? m->arg[1] : NULL, NULL);
+
+  pb_tmpl_send (s, tm_welcome, m->to, m->from);
+  if (!strncmp (m->from, s->master, strlen(s->master)))
+    pb_tmpl_send (s, tm_master, s->master, my_key);
+
+  return 0;
+}
+
+int
+cmd_irc_part (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  PB_CHAN    *c;
+  int        i;
+
+  if (!m->argc) return 0;
+  pb_seen_update (s, m, "part", m->to);
+  if (!pb_irc_casecmp (m->from, s->nick)) {
+    pb_chan_del (s, m->to);
+    return 0;
+  }
+  if ((c = pb_chan_find (s, m->to)) && (i = pb_chan_member_find (c, m->from)) >= 0)
+    pb_chan_member_del (c, i);
+
+  pb_tmpl_send (s, tm_bye, m->to, m->from);
+  return 0;
+}
+
+int
+cmd_irc_kick (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  PB_CHAN    *c;
+  int        i;
+
+  if (m->argc < 2) return 0;
+  if (!pb_irc_casecmp (m->arg[1], s->nick)) pb_chan_del (s, m->to);
+  else if ((c = pb_chan_find (s, m->to)) &&
+	   (i = pb_chan_member_find (c, m->arg[1])) >= 0)
+    pb_chan_member_del (c, i);
+  return 0;
+}
+
+int
+cmd_irc_quit (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  int        i, j;
+
+  pb_seen_update (s, m, "quit", NULL);
+  pb_whois_invalidate (s, m->from);
+  for (i = 0; i < s->n_chan; i++)
+    if ((j = pb_chan_member_find (s->chan[i], m->from)) >= 0)
+      pb_chan_member_del (s->chan[i], j);
+  return 0;
+}
+
+int
+cmd_irc_nick (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  int        i, j;
+
+  if (!m->argc) return 0;
+  pb_whois_invalidate (s, m->from);
+  pb_whois_invalidate (s, m->to);
+  for (i = 0; i < s->n_chan; i++)
+    if ((j = pb_chan_member_find (s->chan[i], m->from)) >= 0) {
+      s->chan[i]->mem += (long) strlen (m->to) - strlen (s->chan[i]->m[j].nick);
+      free (s->chan[i]->m[j].nick);
+      s->chan[i]->m[j].nick = strdup (m->to);
+    }
+  if (!pb_irc_casecmp (m->from, s->nick)) {
+    free (s->nick);
+    s->nick = strdup (m->to);
+  }
+  return 0;
+}
+
+/* RPL_NAMREPLY: 353 me = #channel :[prefixes]nick ... */
+int
+cmd_irc_names (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  PB_CHAN    *c;
+  char       mode[8], *t, *save;
+  int        i;
+
+  if (m->argc < 3 || !(c = pb_chan_find (s, m->arg[m->argc - 2]))) return 0;
+  for (t = strtok_r (m->arg[m->argc - 1], " ", &save); t;
+       t = strtok_r (NULL, " ", &save)) {
+    for (i = 0; i < sizeof(mode) - 1 && t[i] && strchr ("~&@%+", t[i]); i++)
+      mode[i] = t[i];
+    mode[i] = 0;
+    if (t[i]) pb_chan_member_add (c, t + i, NULL, mode);
+  }
+  return 0;
+}
+
+int
+cmd_irc_welcome (PB_SESSION *s, char *buffer, void *arg) {
+  PB_BOT *b = s->bot;
+  char   list[BSIZE];
+
+  // Registration completed. Connection is healthy
+  if (!b) return 0;
+  b->retries = 0;
+
+  pb_irc_join (s, b->channel);
+  pb_printf (s, "PRIVMSG %s :My key is %s\n", s->master, my_key);
+  pb_printf (s, "PRIVMSG %s :Hello Everyone!\n",
+	     pb_irc_chan_list (list, BSIZE, b->channel));
+  return 0;
+}
+
+/* Channel relay. The session of the first bot of net in chan */
+PB_SESSION *
+pb_relay_ses (PB_NET *n, char *chan) {
+  PB_SESSION *s;
+  int        i;
+
+  for (i = 0; i < n_bot; i++) {
+    if (bot[i]->net != n || bot[i]->idx < 0) continue;
+    s = &ses[bot[i]->idx];
+    if (s->func == pb_process_msg && pb_chan_find (s, chan)) return s;
+  }
+  return NULL;
+}
+
+/* Forwards a channel message to the linked channels. Only the PRIVMSG
+ * header is written for each destination. The text stays in the
+ * receive buffer and is queued by reference */
+void
+pb_relay (PB_SESSION *s, PB_IRC_MSG *m) {
+  PB_SESSION *d;
+  char       *text;
+  int        i, k, len;
+
+  if (!s->bot || !m->raw) return;
+  text = m->b ? m->raw + (m->pars - m->b) : m->pars; // Parsed in place or not
+  if (!pb_rb || text < pb_rb->data || text >= pb_rb->data + PB_RBUF_SIZE) return;
+  len = strlen (text);
+  for (i = 0; i < n_relay; i++)
+    for (k = 0; k < 2; k++) {
+      if (relay[i].net[k] != s->bot->net || pb_irc_casecmp (relay[i].chan[k], m->to))
+	continue;
+      if (pb_relay_ses (s->bot->net, m->to) != s) return; // Other bot relays it
+      if (!(d = pb_relay_ses (relay[i].net[!k], relay[i].chan[!k]))) continue;
+      if (d->shed != PB_SHED_NONE) {
+	d->dropped++;
+	continue;
+      }
+      pb_printf (d, "PRIVMSG %s :<%s@%s> ", relay[i].chan[!k], m->from,
+		 relay[i].net[k]->name);
+      pb_out_ref (d, text, len, pb_rb);
+      pb_out_append (d, "\n", 1);
+      pfd[d - ses].events |= POLLOUT;
+      relayed++;
+    }
+}
+
+/* Bot Public Commands implementation */
+int
+cmd_bot_chat (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+
+  fprintf (stderr, "I: Chat mode '%s'\n", buffer);
+  if (strcasestr (buffer, s->nick))
+    pb_tmpl_send (s, tm_chat, m->to, m->from);
+
+  return 0;
+}
+
+int
+cmd_irc_privmsg (PB_SESSION *s, char *buffer, void *arg) {
+  PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+
+  // Ignore my own messages
+  if (!strncasecmp (m->from, s->nick, strlen(s->nick))) return 0;
+  if (!m->to || !m->pars) return 0;
+
+  if (m->to[0] == '#') {
+    pb_hist_add (s, m);
+    pb_seen_update (s, m, "privmsg", m->to);
+    if (pb_flood_check (s, m->from)) return 0;
+    if (n_relay) pb_relay (s, m);
+    if (pb_cmd_mng_run (bot_cm, s, m->pars, m))
+      cmd_bot_chat (s, m->pars, m);
 
   } else {
+    if (pb_flood_check (s, m->from)) return 0;
+    if (!strncmp (m->pars, "\001DCC ", 5)) {
+      pb_dcc_resume (s, m);
+      return 0;
+    }
     if (!strncmp (m->from, s->master, strlen(s->master)) && 
 	!strncasecmp (m->pars, my_key, strlen(my_key))) {
       pb_printf (s, "PRIVMSG %s :Ready master. Running cmd '%s'\n", 
@@ -382,6 +3707,7 @@ cmd_irc_privmsg (PB_SESSION *s, char *buffer, void *arg) {
 
 int
 cmd_bot_quit (PB_SESSION *s, char *buffer, void *arg) {
+  if (s->bot) s->bot->state = PB_BOT_OFF; // Do not reconnect
   pd_del_fd (s->fd);
   return 0;
 }
@@ -389,40 +3715,215 @@ cmd_bot_quit (PB_SESSION *s, char *buffer, void *arg) {
 int
 cmd_bot_help (PB_SESSION *s, char *buffer, void *arg) {
   PB_IRC_MSG *m = (PB_IRC_MSG*) arg;
+  char       key[PB_FACT_KEY], *val;
 
-  pb_printf (s, "PRIVMSG %s :Cannot help you %s. I'm Under Development. "
-	     "Sorry about that\n", m->to, m->from);
+  // Help texts are the "help" and "help <topic>" factoids
+  snprintf (key, sizeof(key), "help%s", buffer + strlen ("@help"));
+  if ((val = pb_fact_get (key)))
+    pb_printf (s, "PRIVMSG %s :%.*s\n", m->to, PB_FACT_VAL, val);
+  else
+    pb_tmpl_send (s, tm_help, m->to, m->from);
   return 0;
 }
 
 int
-pb_process_msg (PB_SESSION *s, char *buffer1) {
-  char *prefix, *cmd, *from, *to, *aux, *pars = NULL; 
-  char buffer[BSIZE];
+pb_process_line (PB_SESSION *s, char *buffer) {
   PB_IRC_MSG m1, *m;
 
-  memset (buffer, 0, BSIZE);
-  if (read(s->fd, buffer, BSIZE) <= 0) return -1;
-  printf ("< %s", buffer);
-  
+  printf ("< %s\n", buffer);
   if (!strncasecmp (buffer, "ping", 4)) {
-    pb_printf (s, "PONG\n");
+    pb_printf (s, "PONG%s\n", buffer + 4);
     return 0;
   }
 
-  m = &m1;
-  memset (m, 0, sizeof (PB_IRC_MSG));
-  pb_irc_msg_parse (m, buffer);
-  pb_cmd_mng_run (irc_cm, s, m->cmd, m);
- 
-  pb_irc_msg_free (m);
-  return 0;
+  m = &m1;
+  memset (m, 0, sizeof (PB_IRC_MSG));
+  m->raw = buffer;
+  if (pb_irc_msg_parse (m, buffer) == 0 && !pb_batch_collect (s, m)) {
+    PB_PROBE3 (parse, s->fd, m->cmd, m->argc);
+    pb_cmd_mng_run (irc_cm, s, m->cmd, m);
+    if (s->await && m->cmd[0] >= '0' && m->cmd[0] <= '9') pb_await_run (s, m);
+  }
+ 
+  pb_irc_msg_free (m);
+  return 0;
+}
+
+/* Session input. Reads land in the loop receive buffer, after the
+ * partial line left by the previous read. Only a partial line waits
+ * in the session, in a buffer of its size, so idle sessions hold no
+ * I/O buffers */
+
+/* The receive buffer, empty, unless lines in it wait for dispatch.
+ * If relayed lines still point to it the loop takes a new one */
+PB_RBUF *
+pb_rbuf_get (void) {
+  if (n_disp) return pb_rb;
+  if (pb_rb && pb_rb->ref > 1) {
+    pb_rbuf_put (pb_rb);
+    pb_rb = NULL;
+  }
+  if (!pb_rb && (pb_rb = rb_free))
+    rb_free = pb_rb->next;
+  else if (!pb_rb && hugepages) {
+    if ((pb_rb = pb_arena_alloc (sizeof(PB_RBUF))) == NULL) return NULL;
+    pb_rb->pool = 1;
+  }
+  else if (!pb_rb) {
+    if ((pb_rb = malloc (sizeof(PB_RBUF))) == NULL) return NULL;
+    pb_rb->pool = 0;
+  }
+  pb_rb->ref = 1;
+  pb_rb->len = 0;
+  return pb_rb;
+}
+
+/* Reads up to size - 1 bytes of s into buf, partial line included.
+ * Returns the bytes in buf, 0 if there was nothing to read or -1 */
+int
+pb_ses_fill (PB_SESSION *s, char *buf, int size) {
+  char *p;
+  int  r;
+
+  if (size > PB_SCRATCH) size = PB_SCRATCH;
+  r = pb_read (s, buf + s->rlen, size - 1 - s->rlen);
+  if (r < 0 && errno == EAGAIN) return 0;
+  if (r <= 0) return -1;
+  PB_PROBE2 (read, s->fd, r);
+  if (s->skip) { // Rest of a dropped line
+    if (!(p = memchr (buf, '\n', r))) return 0;
+    r -= ++p - buf;
+    memmove (buf, p, r);
+    s->skip = 0;
+  }
+  if (lowlat) setsockopt (s->fd, IPPROTO_TCP, TCP_QUICKACK, &lowlat, sizeof(int));
+  if (s->rlen) memcpy (buf, s->rbuf, s->rlen);
+  r += s->rlen;
+  buf[r] = 0;
+  free (s->rbuf);
+  s->rbuf = NULL;
+  s->rlen = s->rsize = 0;
+  return r;
+}
+
+// Keeps the partial line at p for the next read
+int
+pb_ses_keep (PB_SESSION *s, char *p, int len) {
+  if (len >= PB_LINE_MAX) {
+    fprintf (stderr, "E: Line too long. Dropped\n");
+    s->skip = 1;
+    len = 0;
+  }
+  if (len) {
+    if ((s->rbuf = malloc (len)) == NULL) return -1;
+    memcpy (s->rbuf, p, len);
+    s->rlen = s->rsize = len;
+  }
+  return 0;
+}
+
+/* Reads whatever is available and processes the complete lines */
+int
+pb_process_msg (PB_SESSION *s, char *buffer1) {
+  char     *buf, *p, *e;
+  unsigned gen = s->gen;
+  int      len;
+
+  if (s->shed == PB_SHED_PAUSE) return 0; // Just writing. See pb_ses_budget
+  if (!pb_rbuf_get ()) return -1;
+  buf = pb_rb->data + pb_rb->len;
+  if ((len = pb_ses_fill (s, buf, PB_RBUF_SIZE - pb_rb->len)) <= 0) return len;
+
+  for (p = buf; (e = memchr (p, '\n', buf + len - p)); p = e + 1) {
+    *e = 0;
+    if (e > p && e[-1] == '\r') e[-1] = 0;
+    if (*p) pb_process_line (s, p);
+    if (s->gen != gen) return 0; // Session closed by a handler
+  }
+  return pb_ses_keep (s, p, buf + len - p);
+}
+
+/* Event loop pipeline. Instead of running each ready session from
+ * read to write, the loop reads and parses the lines of many of them
+ * into a batch (pb_disp_read), runs the handlers of the batch and
+ * then writes the output of its sessions (pb_disp_run). Lines are
+ * parsed in place in the receive buffer and keep their order */
+void
+pb_disp_run (void) {
+  PB_DISP    *d;
+  PB_SESSION *s;
+  int        i;
+
+  for (i = 0; i < n_disp; i++) {
+    d = &pb_disp[i];
+    if ((s = d->s)->gen != d->gen) continue;
+    if (!d->m.cmd) {
+      pb_printf (s, "PONG%s\n", d->m.raw + 4);
+      continue;
+    }
+    if (pb_batch_collect (s, &d->m)) continue;
+    if (d->c) pb_cmd_call (d->c, s, d->m.cmd, &d->m);
+    else fprintf (stderr, "E: cmd '%s' unknown\n", d->m.cmd);
+    if (s->await && d->m.cmd[0] >= '0' && d->m.cmd[0] <= '9') pb_await_run (s, &d->m);
+  }
+  // Write the replies. Lines of a session are together
+  for (i = 0; i < n_disp; i++) {
+    d = &pb_disp[i];
+    if ((s = d->s)->gen != d->gen || (i + 1 < n_disp && pb_disp[i + 1].s == s))
+      continue;
+    if (pb_out_flush (s) < 0 || pb_ses_budget (s) < 0) pd_del_index (s - ses);
+  }
+  n_disp = 0;
+}
+
+void
+pb_disp_add (PB_SESSION *s, char *line) {
+  PB_DISP *d;
+
+  printf ("< %s\n", line);
+  if (n_disp == PB_DISP_MAX) pb_disp_run ();
+  d = &pb_disp[n_disp];
+  memset (&d->m, 0, sizeof(PB_IRC_MSG));
+  d->s = s;
+  d->gen = s->gen;
+  d->c = NULL;
+  d->m.raw = line;
+  if (strncasecmp (line, "ping", 4)) {
+    if (pb_irc_msg_split (&d->m, line) < 0) return;
+    PB_PROBE3 (parse, s->fd, d->m.cmd, d->m.argc);
+    d->c = pb_cmd_mng_find (irc_cm, d->m.cmd);
+  }
+  n_disp++;
+}
+
+int
+pb_disp_read (PB_SESSION *s) {
+  char     *buf, *p, *e;
+  unsigned gen = s->gen;
+  int      len;
+
+  if (s->shed == PB_SHED_PAUSE) return 0;
+  if (pb_rb && n_disp && PB_RBUF_SIZE - pb_rb->len <= s->rlen + BSIZE)
+    pb_disp_run (); // No room for a line
+  if (!pb_rbuf_get ()) return -1;
+  buf = pb_rb->data + pb_rb->len;
+  if ((len = pb_ses_fill (s, buf, PB_RBUF_SIZE - pb_rb->len)) <= 0) return len;
+
+  for (p = buf; (e = memchr (p, '\n', buf + len - p)); p = e + 1) {
+    *e = 0;
+    if (e > p && e[-1] == '\r') e[-1] = 0;
+    if (*p) pb_disp_add (s, p);
+    if (s->gen != gen) return 0; // Closed by a handler of a full batch
+  }
+  if (n_disp) pb_rb->len = p - pb_rb->data;
+  return pb_ses_keep (s, p, buf + len - p);
 }
 
 /* Control Channel Message */
 int
 cmd_ctrl_help (PB_SESSION *s, char *buffer, void *arg) {
-  pb_printf (s, "< Command list:\n< connect host nick channel master\n< list\n< quit\n");
+  pb_printf (s, "< Command list:\n< connect host nick channel master [[+]port]\n"
+	     "< list\n< quit\n");
   return 0;
 }
 
@@ -434,26 +3935,51 @@ cmd_ctrl_quit (PB_SESSION *s, char *buffer, void *arg) {
 
 int
 cmd_ctrl_list (PB_SESSION *s, char *buffer, void *arg) {
-  int i;
+  int i, j;
   
-  for (i = 0; i < MAX_CONN; i++)
-    if (ses[i].fd != -1) pb_printf (s, "< [%s@%s]\t : Master <%s>\n",
-				    ses[i].nick, ses[i].host, ses[i].master);
+  long long now = pb_now_ms ();
+  
+  for (i = 0; i < MAX_CONN; i++) {
+    if (ses[i].fd == -1) continue;
+    pb_printf (s, "< [%s@%s]\t : Master <%s> mem %ldK%s", ses[i].nick,
+	       ses[i].host, ses[i].master, (pb_ses_mem (&ses[i]) + 1023) / 1024,
+	       ses[i].shed == PB_SHED_PAUSE ? " (paused)" :
+	       ses[i].shed == PB_SHED_DROP ? " (shedding)" : "");
+    if (ses[i].dropped) pb_printf (s, " dropped %d", ses[i].dropped);
+    for (j = 0; j < ses[i].n_chan; j++)
+      pb_printf (s, " %s(%d)", ses[i].chan[j]->name, ses[i].chan[j]->n);
+    if (ses[i].dcc)
+      pb_printf (s, " %s '%s' %lld/%lld", ses[i].func == pb_dcc_send ?
+		 "sending" : "offering", ses[i].dcc->name,
+		 (long long) ses[i].dcc->off, (long long) ses[i].dcc->size);
+    pb_printf (s, "\n");
+  }
+  for (i = 0; i < n_bot; i++)
+    if (bot[i]->state == PB_BOT_WAIT)
+      pb_printf (s, "< [%s@%s]\t : Reconnecting in %lld ms (retry %d)\n",
+		 bot[i]->nick, bot[i]->net->host,
+		 bot[i]->next_try > now ? bot[i]->next_try - now : 0,
+		 bot[i]->retries);
   
   return 0;
 }
 
 int
 cmd_ctrl_connect (PB_SESSION *s, char *buffer, void *arg) {
-  char host[1024], nick[1024], channel[1024], master[1024];
-  int  fd1;
+  char host[1024], nick[1024], channel[1024], master[1024], port[32];
+  PB_NET *n;
   
-  sscanf (buffer + strlen("connect "), "%s %s %s %s", 
-	  host, nick, channel, master);
-  if (pb_add_session (host, nick, channel, master) < 0)
+  strcpy (port, "6667");
+  if (sscanf (buffer + strlen("connect "), "%1023s %1023s %1023s %1023s %31s", 
+	      host, nick, channel, master, port) < 4) {
+    pb_printf (s, "< Usage: connect host nick channel master [[+]port]\n");
+    return 0;
+  }
+  if (!(n = pb_net_find (host, port))) n = pb_net_add (host, host, port);
+  if (!n || !pb_bot_add (n, nick, master, channel))
     pb_printf (s, "< Cannot initiate instance\n");
   else
-    pb_printf (s, "< Bot instance '%s@host' running\n", nick, host);
+    pb_printf (s, "< Bot instance '%s@%s' scheduled\n", nick, host);
   return 0;
 }
 
@@ -485,10 +4011,13 @@ pb_ctrl_accept (PB_SESSION *s, char *buffer) {
   fprintf (stderr, "I: Accepting connection\n");
   if ((cfd = accept (s->fd,  (struct sockaddr*)&client, &slen)) < 0) {
     perror ("pb_ctrl_accept:");
-    return -1;
+    return 0;
   }
 
-  i = pb_add_fd (cfd);
+  if ((i = pb_add_fd (cfd)) < 0) {
+    close (cfd);
+    return 0;
+  }
   ses[i].func = proc_ctrl_msg;
   ses[i].host = strdup ("N/A");
   ses[i].master = strdup ("N/A");
@@ -498,38 +4027,773 @@ pb_ctrl_accept (PB_SESSION *s, char *buffer) {
   return 0;
 }
 
+/* Admin API. Machine oriented version of the control channel on a Unix
+ * socket. Requests and responses are framed as "<length> <json>\n".
+ * Requests can be pipelined and carry an "id" that is echoed back.
+ * Listings are streamed as one frame per item ("more":true) followed
+ * by a final frame with "done":true. Items are written as the client
+ * reads them, and requests after a listing wait for it to end */
+typedef struct pb_admin_req_t {
+  char *id;    // Raw JSON value
+  char *json;
+} PB_ADMIN_REQ;
+
+/* Gets the value of a key from a flat JSON object. With raw the value
+ * is copied as it is, otherwise strings are unquoted */
+char *
+pb_json_get (char *json, char *key, char *out, int size, int raw) {
+  char *p, *o = out;
+  int  klen = strlen (key);
+
+  for (p = json; (p = strchr (p, '"')); p++) {
+    if (strncmp (p + 1, key, klen) || p[klen + 1] != '"') continue;
+    for (p += klen + 2; *p == ' '; p++);
+    if (*p++ != ':') continue;
+    for (; *p == ' '; p++);
+    if (*p == '"' && !raw) {
+      for (p++; *p && *p != '"' && o < out + size - 1; p++) {
+	if (*p == '\\' && p[1]) p++;
+	*o++ = *p;
+      }
+    }
+    else if (*p == '"') {
+      for (*o++ = *p++; *p && *p != '"' && o < out + size - 2; p++) {
+	if (*p == '\\' && p[1]) *o++ = *p++;
+	*o++ = *p;
+      }
+      *o++ = '"';
+    }
+    else
+      for (; *p && !strchr (",} \t\r\n", *p) && o < out + size - 1; p++)
+	*o++ = *p;
+    *o = 0;
+    return out;
+  }
+  return NULL;
+}
+
+char *
+pb_json_esc (char *out, int size, char *str) {
+  char *o = out;
+
+  for (; str && *str && o < out + size - 7; str++) {
+    if (*str == '"' || *str == '\\') *o++ = '\\';
+    if ((unsigned char) *str < 0x20)
+      o += sprintf (o, "\\u%04x", *str);
+    else
+      *o++ = *str;
+  }
+  *o = 0;
+  return out;
+}
+
+int
+pb_admin_reply (PB_SESSION *s, char *fmt, ...) {
+  char    buf[BSIZE], hdr[16];
+  int     len;
+  va_list arg;
+
+  va_start (arg, fmt);
+  if ((len = vsnprintf (buf, BSIZE - 1, fmt, arg)) >= BSIZE - 1) {
+    fprintf (stderr, "Output truncated!!!\n");
+    len = BSIZE - 2;
+  }
+  va_end (arg);
+  buf[len++] = '\n';
+  pb_out_append (s, hdr, snprintf (hdr, sizeof(hdr), "%d ", len - 1));
+  return pb_out_append (s, buf, len);
+}
+
+int
+cmd_admin_help (PB_SESSION *s, char *buffer, void *arg) {
+  PB_ADMIN_REQ *r = (PB_ADMIN_REQ*) arg;
+
+  pb_admin_reply (s, "{\"id\":%s,\"ok\":true,\"commands\":[\"list\","
+		  "\"status\",\"connect\",\"help\"]}", r->id);
+  return 0;
+}
+
 int
-pb_add_session (char *host, char *nick, char *channel, char *master) {
-  int        i, fd1;
-  PB_SESSION *s;
+cmd_admin_status (PB_SESSION *s, char *buffer, void *arg) {
+  PB_ADMIN_REQ *r = (PB_ADMIN_REQ*) arg;
+  int          i, n = 0, st[PB_BOT_OFF + 1];
 
-  if ((fd1 = pb_connect (host, "6667")) < 0) return -1;
-    
+  memset (st, 0, sizeof(st));
+  for (i = 0; i < MAX_CONN; i++) if (ses[i].fd != -1) n++;
+  for (i = 0; i < n_bot; i++) st[bot[i]->state]++;
+  pb_admin_reply (s, "{\"id\":%s,\"ok\":true,\"sessions\":%d,\"bots\":%d,"
+		  "\"running\":%d,\"connecting\":%d,\"waiting\":%d,\"off\":%d,"
+		  "\"networks\":%d,\"flood_ignored\":%ld,"
+		  "\"relayed\":%ld}", r->id, n, n_bot,
+		  st[PB_BOT_RUNNING], st[PB_BOT_CONNECTING], st[PB_BOT_WAIT],
+		  st[PB_BOT_OFF], n_net, flood_ignored, relayed);
+  return 0;
+}
 
-  if ((i = pb_add_fd (fd1)) < 0) return -1;
+/* Writes list items until the output reaches PB_ADMIN_HWM. Called
+ * again as the client reads them */
+int
+pb_admin_more (PB_SESSION *s) {
+  PB_ADMIN_LIST *a = s->alist;
+  char          nick[256], host[256], master[256], chan[BSIZE / 2], name[256];
+  int           i, j, len;
+  long long     now = pb_now_ms ();
 
-  ses[i].host = strdup (host);
-  ses[i].master = strdup (master);
-  ses[i].func = pb_process_msg;
+  for (; a->next < MAX_CONN + n_bot && s->olen - s->ooff < PB_ADMIN_HWM; a->next++) {
+    if ((i = a->next) < MAX_CONN) {
+      if (ses[i].fd == -1) continue;
+      for (len = 0, j = 0; j < ses[i].n_chan && len < sizeof(chan) - 320; j++)
+	len += sprintf (chan + len, "%s{\"name\":\"%s\",\"members\":%d}",
+			j ? "," : "",
+			pb_json_esc (name, sizeof(name), ses[i].chan[j]->name),
+			ses[i].chan[j]->n);
+      chan[len] = 0;
+      pb_admin_reply (s, "{\"id\":%s,\"more\":true,\"item\":{\"slot\":%d,"
+		      "\"type\":\"%s\",\"nick\":\"%s\",\"host\":\"%s\","
+		      "\"master\":\"%s\",\"tls\":%s,\"ktls\":%d,\"caps\":%d,"
+		      "\"mem\":%ld,\"shed\":%d,\"dropped\":%d,"
+		      "\"channels\":[%s]}}", a->id, i,
+		      ses[i].func == pb_process_msg ? "irc" :
+		      ses[i].bot ? "connecting" : "local",
+		      pb_json_esc (nick, sizeof(nick), ses[i].nick),
+		      pb_json_esc (host, sizeof(host), ses[i].host),
+		      pb_json_esc (master, sizeof(master), ses[i].master),
+		      ses[i].ssl ? "true" : "false", ses[i].ktls, ses[i].caps,
+		      pb_ses_mem (&ses[i]), ses[i].shed, ses[i].dropped, chan);
+    }
+    else {
+      i -= MAX_CONN;
+      if (bot[i]->state != PB_BOT_WAIT && bot[i]->state != PB_BOT_OFF) continue;
+      pb_admin_reply (s, "{\"id\":%s,\"more\":true,\"item\":{\"slot\":-1,"
+		      "\"type\":\"%s\",\"nick\":\"%s\",\"host\":\"%s\","
+		      "\"retries\":%d,\"retry_in\":%lld}}", a->id,
+		      bot[i]->state == PB_BOT_WAIT ? "waiting" : "off",
+		      pb_json_esc (nick, sizeof(nick), bot[i]->nick),
+		      pb_json_esc (host, sizeof(host), bot[i]->net->host),
+		      bot[i]->retries, bot[i]->state == PB_BOT_WAIT &&
+		      bot[i]->next_try > now ? bot[i]->next_try - now : 0);
+    }
+    a->cnt++;
+  }
+  if (a->next < MAX_CONN + n_bot) return 0;
+  pb_admin_reply (s, "{\"id\":%s,\"done\":true,\"count\":%d}", a->id, a->cnt);
+  free (a);
+  s->alist = NULL;
+  return 0;
+}
 
-  s = &ses[i];  
+int
+cmd_admin_list (PB_SESSION *s, char *buffer, void *arg) {
+  PB_ADMIN_REQ *r = (PB_ADMIN_REQ*) arg;
 
-  pb_irc_register (s, nick, "Too sexy for this server");
-  pb_irc_join (s, channel);
-  pb_printf (s, "PRIVMSG %s :My key is %s\n", s->master, my_key);
-  pb_printf (s, "PRIVMSG #%s :Hello Everyone!\n", channel);
+  if ((s->alist = calloc (1, sizeof(PB_ADMIN_LIST))) == NULL) {
+    pb_admin_reply (s, "{\"id\":%s,\"ok\":false,\"error\":\"no memory\"}",
+		    r->id);
+    return 0;
+  }
+  snprintf (s->alist->id, sizeof(s->alist->id), "%s", r->id);
+  return pb_admin_more (s);
+}
+
+int
+cmd_admin_connect (PB_SESSION *s, char *buffer, void *arg) {
+  PB_ADMIN_REQ *r = (PB_ADMIN_REQ*) arg;
+  char         host[256], nick[256], channel[256], master[256], port[32];
+  PB_NET       *n;
+
+  if (!pb_json_get (r->json, "host", host, sizeof(host), 0) ||
+      !pb_json_get (r->json, "nick", nick, sizeof(nick), 0) ||
+      !pb_json_get (r->json, "channel", channel, sizeof(channel), 0) ||
+      !pb_json_get (r->json, "master", master, sizeof(master), 0)) {
+    pb_admin_reply (s, "{\"id\":%s,\"ok\":false,\"error\":\"host, nick, "
+		    "channel and master required\"}", r->id);
+    return 0;
+  }
+  if (!pb_json_get (r->json, "port", port, sizeof(port), 0))
+    strcpy (port, "6667");
+  if (!(n = pb_net_find (host, port))) n = pb_net_add (host, host, port);
+  if (!n || !pb_bot_add (n, nick, master, channel))
+    pb_admin_reply (s, "{\"id\":%s,\"ok\":false,\"error\":\"cannot add bot\"}",
+		    r->id);
+  else
+    pb_admin_reply (s, "{\"id\":%s,\"ok\":true}", r->id);
+  return 0;
+}
+
+int
+pb_admin_req (PB_SESSION *s, char *json) {
+  PB_ADMIN_REQ r;
+  char         id[128], cmd[64];
+  int          i = admin_cm->n;
+
+  r.json = json;
+  r.id = pb_json_get (json, "id", id, sizeof(id), 1) ? id : "null";
+  // The whole name. Not the prefix match of the text interfaces
+  if (pb_json_get (json, "cmd", cmd, sizeof(cmd), 0))
+    for (i = 0; i < admin_cm->n && strcmp (admin_cm->cmd[i]->id, cmd); i++);
+  if (i < admin_cm->n) pb_cmd_call (admin_cm->cmd[i], s, cmd, &r);
+  else
+    pb_admin_reply (s, "{\"id\":%s,\"ok\":false,\"error\":\"unknown command\"}",
+		    r.id);
+  return 0;
+}
+
+/* Processes all the complete frames while the output is not too big */
+int
+pb_admin_frames (PB_SESSION *s) {
+  char *p = s->rbuf, *e, *q, *end = s->rbuf + s->rlen;
+  long len;
+
+  while (p < end && !s->alist && s->olen - s->ooff < PB_ADMIN_HWM) {
+    if (!(e = memchr (p, ' ', end - p))) {
+      if (end - p > 10) return -1;
+      break;
+    }
+    len = strtol (p, &q, 10);
+    if (q != e || len <= 0 || len > BSIZE - 32) return -1;
+    if (end - e < len + 2) break; // Incomplete
+    if (e[len + 1] != '\n') return -1;
+    e[len + 1] = 0;
+    pb_admin_req (s, e + 1);
+    p = e + len + 2;
+  }
+  s->rlen = end - p;
+  memmove (s->rbuf, p, s->rlen);
+  return 0;
+}
+
+int
+proc_admin_msg (PB_SESSION *s, char *buffer1) {
+  int r;
+
+  if (pb_out_flush (s) < 0) return -1;
+  // Do not read more requests while the client is not reading responses
+  if (!s->alist && s->olen - s->ooff < PB_ADMIN_HWM) {
+    if (s->rlen == BSIZE - 1) return -1;
+    if ((r = read (s->fd, s->rbuf + s->rlen, BSIZE - 1 - s->rlen)) == 0 ||
+	(r < 0 && errno != EAGAIN)) {
+      fprintf (stderr, "I: Admin Connection dropped\n");
+      return -1;
+    }
+    if (r > 0) s->rlen += r;
+  }
+  do {
+    if (s->alist) pb_admin_more (s);
+    if (pb_admin_frames (s) < 0) {
+      fprintf (stderr, "E: Bad admin frame. Closing\n");
+      return -1;
+    }
+    if (pb_out_flush (s) < 0) return -1;
+  } while (s->alist && s->olen - s->ooff < PB_ADMIN_HWM);
+  if (!s->alist && s->olen - s->ooff < PB_ADMIN_HWM) pfd[s - ses].events |= POLLIN;
+  else pfd[s - ses].events &= ~POLLIN;
+
+  return 0;
+}
+
+int
+pb_admin_accept (PB_SESSION *s, char *buffer) {
+  struct ucred cred;
+  socklen_t    len = sizeof(cred);
+  int          cfd, i;
+  char         name[1024];
+
+  if ((cfd = accept4 (s->fd, NULL, NULL, SOCK_NONBLOCK)) < 0) {
+    perror ("pb_admin_accept:");
+    return 0;
+  }
+  if (getsockopt (cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+      (cred.uid != 0 && cred.uid != getuid () && cred.uid != admin_uid)) {
+    fprintf (stderr, "E: Admin connection from uid %d rejected\n",
+	     (int) cred.uid);
+    close (cfd);
+    return 0;
+  }
+  if ((i = pb_add_fd (cfd)) < 0 || (ses[i].rbuf = malloc (BSIZE)) == NULL) {
+    if (i < 0) close (cfd);
+    else pd_del_index (i);
+    return 0;
+  }
+  ses[i].func = proc_admin_msg;
+  ses[i].rsize = BSIZE;
+  ses[i].host = strdup ("unix");
+  ses[i].master = strdup ("N/A");
+  snprintf (name, 1024, "Admin-%d-%d", (int) cred.pid, i);
+  ses[i].nick = strdup (name);
+
+  return 0;
+}
+
+int
+pb_unix_server (char *path) {
+  struct sockaddr_un server;
+  int                s;
+
+  if ((s = socket (AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    perror ("pb_unix_server (socket):");
+    return -1;
+  }
+  memset (&server, 0, sizeof(server));
+  server.sun_family = AF_UNIX;
+  snprintf (server.sun_path, sizeof(server.sun_path), "%s", path);
+  unlink (path);
+
+  if ((bind (s, (struct sockaddr *) &server, sizeof(server))) < 0) {
+    perror ("pb_unix_server (bind):");
+    goto cleanup;
+  }
+  chmod (path, 0660);
+  if ((listen (s, 10)) < 0) {
+    perror ("pb_unix_server (listen):");
+    goto cleanup;
+  }
+
+  return s;
+ cleanup:
+  close (s);
+  return -1;
+}
+
+/* Transport ready. Start the IRC registration */
+int
+pb_session_start (PB_SESSION *s) {
+  PB_BOT    *b = s->bot;
+
+  // From here on the bot is not counted as a pending connect
+  b->state = PB_BOT_RUNNING;
+  b->net->pending--;
+  pending--;
+
+  // Socket stays non-blocking. A stuck server must not block the loop
+  pfd[s - ses].events = POLLIN;
+  s->func = pb_process_msg;
+
+  // Channels are joined once registered. See cmd_irc_welcome
+  pb_irc_register (s, b->nick, "Too sexy for this server");
       
   return 0;
 }
 
+/* Non-blocking TLS handshake driven by poll. When done, try to
+ * move record processing to the kernel so the session keeps using
+ * plain read/write on the fd */
 int
-main (int argc, char *argv[]) {
-  PB_SESSION     pb_s, *s;
-  char           buffer[BSIZE];
-  int            i, n, r, fd1;
+pb_tls_handshake (PB_SESSION *s, char *buffer) {
+  int r;
 
-  printf ("picoBot v 0.4\n");
-  for (i = 0; i < MAX_CONN; ses[i].fd = pfd[i++].fd = -1);
+  if ((r = SSL_connect (s->ssl)) <= 0) {
+    switch (SSL_get_error (s->ssl, r)) {
+    case SSL_ERROR_WANT_READ:
+      pfd[s - ses].events = POLLIN;
+      return 0;
+    case SSL_ERROR_WANT_WRITE:
+      pfd[s - ses].events = POLLOUT;
+      return 0;
+    }
+    fprintf (stderr, "E: TLS handshake with '%s' failed: %s\n", s->host,
+	     ERR_reason_error_string (ERR_get_error ()));
+    return -1;
+  }
+  if (BIO_get_ktls_send (SSL_get_wbio (s->ssl))) s->ktls |= PB_KTLS_TX;
+  if (BIO_get_ktls_recv (SSL_get_rbio (s->ssl))) s->ktls |= PB_KTLS_RX;
+  fprintf (stderr, "I: TLS with '%s' up (%s). kTLS tx:%s rx:%s\n", s->host,
+	   SSL_get_cipher (s->ssl), s->ktls & PB_KTLS_TX ? "yes" : "no",
+	   s->ktls & PB_KTLS_RX ? "yes" : "no");
+
+  return pb_session_start (s);
+}
+
+int
+pb_tls_init (void) {
+  if (tls_ctx) return 0;
+  if ((tls_ctx = SSL_CTX_new (TLS_client_method ())) == NULL) return -1;
+  SSL_CTX_set_min_proto_version (tls_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options (tls_ctx, SSL_OP_ENABLE_KTLS);
+  // Sockets are non-blocking and the output queue moves when it grows
+  SSL_CTX_clear_mode (tls_ctx, SSL_MODE_AUTO_RETRY);
+  SSL_CTX_set_mode (tls_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+		    SSL_MODE_ENABLE_PARTIAL_WRITE);
+  SSL_CTX_set_default_verify_paths (tls_ctx);
+  SSL_CTX_set_verify (tls_ctx, tls_verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE,
+		      NULL);
+  return 0;
+}
+
+/* TCP connection established (or failed) */
+int
+pb_connect_done (PB_SESSION *s, char *buffer) {
+  PB_BOT    *b = s->bot;
+  int       err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt (s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+    fprintf (stderr, "E: Cannot connect to '%s':%s (%s)\n",
+	     b->net->host, b->net->port, strerror (err));
+    // Try next address on the next attempt. Resolve again when exhausted
+    if (b->net->ai_cur && !(b->net->ai_cur = b->net->ai_cur->ai_next)) {
+      freeaddrinfo (b->net->ai);
+      b->net->ai = NULL;
+    }
+    return -1;
+  }
+  pb_lowlat_sock (s->fd);
+  if (!b->net->tls) return pb_session_start (s);
+
+  // Handshake still counts as a pending connect
+  if (pb_tls_init () < 0 || (s->ssl = SSL_new (tls_ctx)) == NULL) {
+    fprintf (stderr, "E: Cannot create TLS session\n");
+    return -1;
+  }
+  SSL_set_fd (s->ssl, s->fd);
+  SSL_set_tlsext_host_name (s->ssl, b->net->host);
+  if (tls_verify) SSL_set1_host (s->ssl, b->net->host);
+  s->func = pb_tls_handshake;
+
+  return pb_tls_handshake (s, buffer);
+}
+
+/* Starts connecting a bot. Registration happens in pb_connect_done */
+int
+pb_add_session (PB_BOT *b) {
+  int        i, fd1;
+
+  if ((fd1 = pb_connect_nb (b->net)) < 0) return -1;
+  if ((i = pb_add_fd (fd1)) < 0) {
+    close (fd1);
+    return -1;
+  }
+
+  ses[i].host = strdup (b->net->host);
+  ses[i].master = strdup (b->master);
+  ses[i].func = pb_connect_done;
+  ses[i].bot = b;
+  pfd[i].events = POLLOUT;
+
+  b->idx = i;
+  b->state = PB_BOT_CONNECTING;
+  b->next_try = pb_now_ms () + PB_CONN_TMO;
+  b->net->pending++;
+  pending++;
+
+  return i;
+}
+
+/* Connection scheduler */
+PB_NET *
+pb_net_find (char *name, char *port) {
+  int i;
+
+  for (i = 0; i < n_net; i++)
+    if ((!port && !strcmp (net[i]->name, name)) ||
+	(port && !strcmp (net[i]->host, name) &&
+	 net[i]->tls == (*port == '+') &&
+	 !strcmp (net[i]->port, port + (*port == '+'))))
+      return net[i];
+  return NULL;
+}
+
+PB_NET *
+pb_net_add (char *name, char *host, char *port) {
+  PB_NET **aux, *n;
+
+  if (!name || !host || !port) return NULL;
+  if ((aux = realloc (net, sizeof(PB_NET*) * (n_net + 1))) == NULL)
+    return NULL;
+  net = aux;
+  n = calloc (1, sizeof(PB_NET));
+  n->name = strdup (name);
+  n->host = strdup (host);
+  if ((n->tls = (*port == '+'))) port++; // +6697 is TLS
+  n->port = strdup (port);
+  n->throttle = PB_THROTTLE;
+  n->max_pend = PB_MAX_PEND;
+  net[n_net++] = n;
+
+  return n;
+}
+
+PB_BOT *
+pb_bot_add (PB_NET *n, char *nick, char *master, char *channel) {
+  PB_BOT **aux, *b;
+
+  if (!n || !nick || !master || !channel) return NULL;
+  if ((aux = realloc (bot, sizeof(PB_BOT*) * (n_bot + 1))) == NULL)
+    return NULL;
+  bot = aux;
+  b = calloc (1, sizeof(PB_BOT));
+  b->net = n;
+  b->nick = strdup (nick);
+  b->master = strdup (master);
+  b->channel = strdup (channel);
+  b->state = PB_BOT_WAIT;
+  b->idx = -1;
+  bot[n_bot++] = b;
+
+  return b;
+}
+
+/* Exponential backoff with jitter. Half the delay is fixed and half
+ * is random so bots dropped by the same outage spread their retries */
+void
+pb_bot_dropped (PB_BOT *b) {
+  long long delay;
+
+  if (b->state == PB_BOT_CONNECTING) {
+    b->net->pending--;
+    pending--;
+  }
+  b->idx = -1;
+  if (b->state == PB_BOT_OFF) return;
+
+  delay = backoff_min;
+  if (b->retries < 30) delay <<= b->retries;
+  if (delay > backoff_max) delay = backoff_max;
+  delay = delay / 2 + random () % (delay / 2 + 1);
+
+  b->retries++;
+  b->state = PB_BOT_WAIT;
+  b->next_try = pb_now_ms () + delay;
+  fprintf (stderr, "I: Bot '%s@%s' reconnecting in %lld ms\n",
+	   b->nick, b->net->host, delay);
+}
+
+/* Starts all connects that are due and allowed by the throttles.
+ * Returns the time in ms until the scheduler needs to run again */
+int
+pb_sched_run (void) {
+  long long now = pb_now_ms (), tmo = PB_TMO;
+  PB_BOT    *b;
+  PB_NET    *n;
+  int       i;
+
+  for (i = 0; i < n_bot; i++) {
+    b = bot[i];
+    if (b->state == PB_BOT_CONNECTING && b->next_try <= now) {
+      fprintf (stderr, "E: Connect to '%s' timed out\n", b->net->host);
+      pd_del_index (b->idx);
+      continue;
+    }
+    if (b->state != PB_BOT_WAIT) continue;
+    if (b->next_try > now) {
+      if (b->next_try - now < tmo) tmo = b->next_try - now;
+      continue;
+    }
+    // Global ramp and per-server limits. Completions wake up poll
+    n = b->net;
+    if (pending >= ramp || n->pending >= n->max_pend) continue;
+    if (n->next_conn > now) {
+      if (n->next_conn - now < tmo) tmo = n->next_conn - now;
+      continue;
+    }
+    n->next_conn = now + n->throttle;
+    if (pb_add_session (b) < 0) pb_bot_dropped (b);
+  }
+  if (n_dcc) tmo = pb_dcc_run (now, tmo);
+  if (n_await) tmo = pb_await_expire (now, tmo);
+
+  return tmo;
+}
+
+/* Configuration file. One directive per line:
+ *   network name host [+]port [throttle_ms] [max_pending]
+ *   tls_verify 0|1
+ *   admin socket_path [uid]
+ *   budget soft_kb hard_kb
+ *   history dir [segment_kb]
+ *   bot network nick master channel[,channel...]
+ *   ramp max_pending
+ *   backoff min_ms max_ms
+ *   relay network channel network channel
+ *   pipeline 0|1
+ * Channel names go without '#' as that starts a comment. A port
+ * starting with '+' is a TLS port */
+int
+pb_config_load (char *fname) {
+  FILE           *f;
+  char           line[BSIZE], a[5][1024], *p;
+  int            n, l = 0;
+  PB_NET         *nt;
+  struct in_addr ip;
+
+  if ((f = fopen (fname, "r")) == NULL) {
+    perror ("pb_config_load:");
+    return -1;
+  }
+  while (fgets (line, BSIZE, f)) {
+    l++;
+    if ((n = sscanf (line, "%1023s %1023s %1023s %1023s %1023s",
+		     a[0], a[1], a[2], a[3], a[4])) <= 0 || a[0][0] == '#')
+      continue;
+    if (!strcasecmp (a[0], "network") && n >= 4) {
+      nt = pb_net_add (a[1], a[2], a[3]);
+      if (n > 4) nt->throttle = atoi (a[4]);
+      if (sscanf (line, "%*s %*s %*s %*s %*d %d", &nt->max_pend) == 1 &&
+	  nt->max_pend < 1) nt->max_pend = 1;
+    }
+    else if (!strcasecmp (a[0], "bot") && n == 5) {
+      if (!pb_bot_add (pb_net_find (a[1], NULL), a[2], a[3], a[4]))
+	fprintf (stderr, "E: %s:%d: Unknown network '%s'\n", fname, l, a[1]);
+    }
+    else if (!strcasecmp (a[0], "admin") && n >= 2) {
+      admin_path = strdup (a[1]);
+      if (n > 2) admin_uid = atoi (a[2]);
+    }
+    else if (!strcasecmp (a[0], "history") && n >= 2) {
+      hist_dir = strdup (a[1]);
+      if (n > 2) hist_seg = atol (a[2]) * 1024;
+    }
+    else if (!strcasecmp (a[0], "seen") && n >= 2) {
+      seen_path = strdup (a[1]);
+      if (n > 2) seen_slots = atoi (a[2]);
+    }
+    else if (!strcasecmp (a[0], "dcc") && n >= 2) {
+      dcc_dir = strdup (a[1]);
+      if (n > 2) dcc_rate = atol (a[2]) * 1024;
+      if (n > 3) dcc_total = atol (a[3]) * 1024;
+    }
+    else if (!strcasecmp (a[0], "facts") && n == 2)
+      fact_path = strdup (a[1]);
+    else if (!strcasecmp (a[0], "lowlat") && n >= 2) {
+      lowlat = 1;
+      lowlat_spin = atoi (a[1]);
+      for (p = strtok (n > 2 ? a[2] : "", ","); p && n_lowlat_cpu < PB_LOWLAT_CPUS;
+	   p = strtok (NULL, ","))
+	lowlat_cpu[n_lowlat_cpu++] = atoi (p);
+    }
+    else if (!strcasecmp (a[0], "relay") && n == 5) {
+      if (!(nt = pb_net_find (a[1], NULL)) || !pb_net_find (a[3], NULL) ||
+	  !(p = realloc (relay, sizeof(PB_RELAY) * (n_relay + 1)))) {
+	fprintf (stderr, "E: %s:%d: Unknown network\n", fname, l);
+	continue;
+      }
+      relay = (PB_RELAY*) p;
+      relay[n_relay].net[0] = nt;
+      relay[n_relay].net[1] = pb_net_find (a[3], NULL);
+      asprintf (&relay[n_relay].chan[0], "#%s", a[2]);
+      asprintf (&relay[n_relay++].chan[1], "#%s", a[4]);
+    }
+    else if (!strcasecmp (a[0], "pipeline") && n == 2)
+      pipeline = atoi (a[1]);
+    else if (!strcasecmp (a[0], "hugepages") && n == 2)
+      hugepages = atoi (a[1]);
+    else if (!strcasecmp (a[0], "whois_ttl") && n == 2)
+      whois_ttl = atol (a[1]) * 1000;
+    else if (!strcasecmp (a[0], "dcc_ip") && n == 2) {
+      if (inet_pton (AF_INET, a[1], &ip) != 1)
+	fprintf (stderr, "E: %s:%d: dcc_ip needs an IPv4 address\n", fname, l);
+      else
+	dcc_ip = strdup (a[1]);
+    }
+    else if (!strcasecmp (a[0], "flood") && n == 3) {
+      flood_msgs = atoi (a[1]);
+      flood_win = atoi (a[2]) * 1000;
+    }
+    else if (!strcasecmp (a[0], "budget") && n == 3) {
+      mem_soft = atol (a[1]) * 1024;
+      mem_hard = atol (a[2]) * 1024;
+    }
+    else if (!strcasecmp (a[0], "tls_verify") && n == 2)
+      tls_verify = atoi (a[1]);
+    else if (!strcasecmp (a[0], "ramp") && n == 2)
+      ramp = atoi (a[1]);
+    else if (!strcasecmp (a[0], "backoff") && n == 3) {
+      backoff_min = atoi (a[1]);
+      backoff_max = atoi (a[2]);
+    }
+    else
+      fprintf (stderr, "E: %s:%d: Bad directive '%s'\n", fname, l, a[0]);
+  }
+  fclose (f);
+  if (backoff_min < 2) backoff_min = 2;
+  if (ramp < 1) ramp = 1;
+  if (flood_win < 1000) flood_win = 1000;
+
+  return 0;
+}
+
+/* Sessions with data left in OpenSSL by pb_read run as if they had
+ * input. The socket may have nothing to wake poll up for it */
+int
+pb_tls_pending (void) {
+  int i, n = 0;
+
+  tls_pend = 0;
+  for (i = 0; i < MAX_CONN; i++)
+    if (pfd[i].fd != -1 && ses[i].ssl && !(pfd[i].revents & POLLIN) &&
+	SSL_pending (ses[i].ssl)) {
+      pfd[i].revents |= POLLIN;
+      n++;
+    }
+  return n;
+}
+
+/* Event loop. One round */
+int
+pb_loop_run (int tmo) {
+  char buffer[BSIZE];
+  int  i, n = MAX_CONN, r;
+
+  if ((r = pb_poll (pfd, n, tls_pend ? 0 : tmo)) < 0) {
+    if (errno == EINTR) return 0;
+    perror ("poll:");
+    exit (1);
+  }
+  if (tls_pend) r += pb_tls_pending ();
+
+  if (r == 0) return 0; // Timeout. Add Idle Function
+
+  if (!pipeline) {
+    for (i = 0; i < n; i++)  {
+      if (pfd[i].revents & (POLLIN | POLLOUT)) {
+	if (ses[i].func (&ses[i], buffer) < 0 ||
+	    (ses[i].fd != -1 && pb_out_flush (&ses[i]) < 0) ||
+	    (ses[i].func == pb_process_msg && pb_ses_budget (&ses[i]) < 0))
+	  pd_del_index (i);
+      }
+      else if (pfd[i].revents & (POLLHUP | POLLERR)) pd_del_index (i);
+    }
+    return r;
+  }
+
+  // Read and parse the IRC sessions. Others just run
+  for (i = 0; i < n; i++) {
+    if (pfd[i].revents & (POLLIN | POLLOUT)) {
+      if ((ses[i].func == pb_process_msg ? pb_disp_read (&ses[i]) :
+	   ses[i].func (&ses[i], buffer)) < 0)
+	pd_del_index (i);
+    }
+    else if (pfd[i].revents & (POLLHUP | POLLERR)) pd_del_index (i);
+  }
+  pb_disp_run ();
+  // Write everything
+  for (i = 0; i < n; i++)
+    if ((pfd[i].revents & (POLLIN | POLLOUT)) && ses[i].fd != -1 &&
+	(pb_out_flush (&ses[i]) < 0 ||
+	 (ses[i].func == pb_process_msg && pb_ses_budget (&ses[i]) < 0)))
+      pd_del_index (i);
+  return r;
+}
+
+void *
+pb_loop (void *arg) {
+  while (running) pb_loop_run (pb_sched_run ());
+  return NULL;
+}
+
+/* Reply templates and command managers. Shared with the benchmarks */
+void
+pb_cmds_init (void) {
+  // Reply templates
+  tm_welcome = pb_tmpl_new ("PRIVMSG %s :Welcome %s\n");
+  tm_welcome->low = 1;
+  tm_master = pb_tmpl_new ("PRIVMSG %s :Glad to see you again Master. "
+			   "My key is %s\n");
+  tm_bye = pb_tmpl_new ("PRIVMSG %s :Bye %s\n");
+  tm_bye->low = 1;
+  tm_chat = pb_tmpl_new ("PRIVMSG %s :Hey %s sup\n");
+  tm_chat->low = 1;
+  tm_help = pb_tmpl_new ("PRIVMSG %s :Cannot help you %s. I'm Under Development. "
+			 "Sorry about that\n");
 
   // Create command managers
   // Control Command Manager
@@ -539,20 +4803,65 @@ main (int argc, char *argv[]) {
   pb_cmd_mng_add (ctrl_cm, "quit", cmd_ctrl_quit);
   pb_cmd_mng_add (ctrl_cm, "connect", cmd_ctrl_connect);
 
+  // Admin API Command Manager
+  admin_cm = pb_cmd_mng_new ();
+  pb_cmd_mng_add (admin_cm, "list", cmd_admin_list);
+  pb_cmd_mng_add (admin_cm, "status", cmd_admin_status);
+  pb_cmd_mng_add (admin_cm, "connect", cmd_admin_connect);
+  pb_cmd_mng_add (admin_cm, "help", cmd_admin_help);
+
   // IRC command manager
   irc_cm = pb_cmd_mng_new ();
   pb_cmd_mng_add (irc_cm, "join", cmd_irc_join);
   pb_cmd_mng_add (irc_cm, "part", cmd_irc_part);
   pb_cmd_mng_add (irc_cm, "privmsg", cmd_irc_privmsg);
+  pb_cmd_mng_add (irc_cm, "001", cmd_irc_welcome);
+  pb_cmd_mng_add (irc_cm, "cap", cmd_irc_cap);
+  pb_cmd_mng_add (irc_cm, "batch", cmd_irc_batch);
+  pb_cmd_mng_add (irc_cm, "quit", cmd_irc_quit);
+  pb_cmd_mng_add (irc_cm, "nick", cmd_irc_nick);
+  pb_cmd_mng_add (irc_cm, "kick", cmd_irc_kick);
+  pb_cmd_mng_add (irc_cm, "353", cmd_irc_names);
+  pb_cmd_mng_add (irc_cm, "311", cmd_irc_whois);
+  pb_cmd_mng_add (irc_cm, "312", cmd_irc_whois);
+  pb_cmd_mng_add (irc_cm, "317", cmd_irc_whois);
+  pb_cmd_mng_add (irc_cm, "318", cmd_irc_whois);
+  pb_cmd_mng_add (irc_cm, "319", cmd_irc_whois);
+  pb_cmd_mng_add (irc_cm, "352", cmd_irc_whois);
+  pb_cmd_mng_add (irc_cm, "401", cmd_irc_whois);
 
 
   // Bot Public command manager
   bot_cm = pb_cmd_mng_new ();
   pb_cmd_mng_add (bot_cm, "@help", cmd_bot_help);
+  pb_cmd_mng_add (bot_cm, "@last", cmd_bot_last);
+  pb_cmd_mng_add (bot_cm, "@seen", cmd_bot_seen);
+  pb_cmd_mng_add (bot_cm, "@search", cmd_bot_search);
+  pb_cmd_mng_add (bot_cm, "@get", cmd_bot_get);
+  pb_cmd_mng_add (bot_cm, "!fact", cmd_bot_fact);
+  pb_cmd_mng_add (bot_cm, "@whois", cmd_bot_whois);
 
   // Bot Private command manager
   bot_sec_cm = pb_cmd_mng_new ();
   pb_cmd_mng_add (bot_sec_cm, "@quit", cmd_bot_quit);
+}
+
+#ifndef PB_NO_MAIN
+int
+main (int argc, char *argv[]) {
+  PB_SESSION     pb_s, *s;
+  int            i, fd1;
+
+  printf ("picoBot v 0.4\n");
+  for (i = 0; i < MAX_CONN; i++) ses[i].fd = pfd[i].fd = -1;
+  srandom (time (NULL) ^ getpid ());
+  if (argc > 1 && pb_config_load (argv[1]) < 0) exit (1);
+
+  pb_cmds_init ();
+
+  if (pb_hist_init () < 0) exit (1);
+  if (pb_seen_init () < 0) exit (1);
+  if (pb_fact_init () < 0) exit (1);
 
   // Create control channel
   fd1 = pb_server (1337);
@@ -565,22 +4874,22 @@ main (int argc, char *argv[]) {
   ses[i].master = strdup ("N/A");
   ses[i].func = pb_ctrl_accept;
 
-  while (running) {
-     n = MAX_CONN;
-     if ((r = poll (pfd, n, PB_TMO)) < 0) {
-	 perror ("poll:");
-	 exit (1);
-       }
-
-     if (r == 0) continue; // Timeout. Add Idle Function
-
-     for (i = 0; i < n; i++)  {
-	 if (pfd[i].revents & POLLHUP) pd_del_index (i);
-	 if (pfd[i].revents & POLLIN) ses[i].func (&ses[i], buffer);
-       }
-
+  // Create admin channel
+  if (admin_path) {
+    if ((fd1 = pb_unix_server (admin_path)) < 0 || (i = pb_add_fd (fd1)) < 0) {
+      fprintf (stderr, "Cannot create admin socket '%s'\n", admin_path);
+      exit (1);
+    }
+    ses[i].host = strdup ("unix");
+    ses[i].nick = strdup ("Admin");
+    ses[i].master = strdup ("N/A");
+    ses[i].func = pb_admin_accept;
   }
+
+  pb_lowlat_pin (pthread_self (), 0);
+  pb_loop (NULL);
   // Cleanup
   
   return 0;
 }
+#endif